@@ -0,0 +1,201 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the overhead and throughput of OrderedThreadPool.
+//
+// Jobs burn CPU for a set time rather than sleep, like real work would. Job
+// times are drawn once from a fixed seed, so that every run sees the same
+// jobs. Unless noted, each iteration submits a batch of jobs and waits till
+// all are delivered, and items_per_second counts jobs.
+//
+// - DoOverhead: empty jobs, so the time is the cost of Do() and of handing
+//   over the job and its ticket. The argument is the number of workers, 0
+//   running jobs on the calling thread.
+// - Throughput: fixed-time jobs, by number of workers.
+// - Distribution: fixed, exponential and heavy-tailed job times of the same
+//   mean, with and without the reorder buffer. ticket_wait is the part of the
+//   workers' busy time spent waiting for earlier jobs, i.e. head-of-line
+//   blocking.
+// - MaxPendingJobs: the effect of the queue limit on exponential jobs. -1
+//   stands for adaptive_pending_jobs, and 0 for no limit.
+// - ThreadPool vs OrderedThreadPool: the cost of ordering on fixed-time jobs.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../src/ordered_thread_pool.h"
+#include "../src/thread_pool.h"
+
+namespace {
+
+using std::chrono::nanoseconds;
+
+constexpr int kBatchSize = 256;
+constexpr nanoseconds kMeanJobTime = std::chrono::microseconds(20);
+
+enum Distribution { kFixed, kExponential, kHeavyTailed };
+
+// Busy-waits for duration.
+void Burn(nanoseconds duration) {
+  auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end) {
+  }
+}
+
+// kBatchSize job times of mean kMeanJobTime.
+std::vector<nanoseconds> JobTimes(Distribution distribution) {
+  std::mt19937 rng(42);
+  std::vector<nanoseconds> times;
+  double mean = kMeanJobTime.count();
+  std::exponential_distribution<double> exponential(1 / mean);
+  // Pareto with shape 1.5, whose mean is 3 times its minimum. Capped, so that
+  // a single job does not dominate the batch.
+  constexpr double kShape = 1.5;
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (int i = 0; i < kBatchSize; ++i) {
+    double ns = mean;
+    if (distribution == kExponential) {
+      ns = exponential(rng);
+    } else if (distribution == kHeavyTailed) {
+      ns = std::min(mean / 3 / std::pow(1 - uniform(rng), 1 / kShape),
+                    mean * 250);
+    }
+    times.push_back(nanoseconds((int64_t)ns));
+  }
+  return times;
+}
+
+// Submits a job per entry of times, and waits till all are delivered.
+void RunBatch(OrderedThreadPool<int>& pool,
+              const std::vector<nanoseconds>& times) {
+  for (nanoseconds time : times) {
+    pool.Do(
+        [time] {
+          Burn(time);
+          return 0;
+        },
+        [](int result) { benchmark::DoNotOptimize(result); });
+  }
+  pool.WaitIdle();
+}
+
+void BM_DoOverhead(benchmark::State& state) {
+  OrderedThreadPool<int> pool{(int)state.range(0), 1024};
+  for (auto _ : state) {
+    pool.Do([] { return 0; },
+            [](int result) { benchmark::DoNotOptimize(result); });
+  }
+  pool.WaitIdle();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DoOverhead)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+void BM_Throughput(benchmark::State& state) {
+  OrderedThreadPool<int> pool{(int)state.range(0), 16};
+  std::vector<nanoseconds> times = JobTimes(kFixed);
+  for (auto _ : state) {
+    RunBatch(pool, times);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+}
+BENCHMARK(BM_Throughput)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+void BM_Distribution(benchmark::State& state) {
+  OrderedThreadPool<int> pool{4,
+                              {.max_pending_jobs = 16,
+                               .reorder_buffer = state.range(1) != 0,
+                               .collect_stats = true}};
+  std::vector<nanoseconds> times = JobTimes((Distribution)state.range(0));
+  for (auto _ : state) {
+    RunBatch(pool, times);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+  OrderedThreadPoolStats stats = pool.Stats();
+  state.counters["ticket_wait"] =
+      stats.worker_busy_time.count() > 0
+          ? (double)stats.ticket_wait_time.count() /
+                stats.worker_busy_time.count()
+          : 0;
+}
+BENCHMARK(BM_Distribution)
+    ->ArgNames({"distribution", "reorder"})
+    ->ArgsProduct({{kFixed, kExponential, kHeavyTailed}, {0, 1}})
+    ->UseRealTime();
+
+void BM_MaxPendingJobs(benchmark::State& state) {
+  int limit = state.range(0);
+  // The adaptive limit starts at 1.
+  OrderedThreadPool<int> pool{4,
+                              {.max_pending_jobs = limit < 0 ? 1 : limit,
+                               .adaptive_pending_jobs = limit < 0}};
+  std::vector<nanoseconds> times = JobTimes(kExponential);
+  for (auto _ : state) {
+    RunBatch(pool, times);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+  state.counters["max_pending_jobs"] = pool.max_pending_jobs();
+}
+BENCHMARK(BM_MaxPendingJobs)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Arg(64)
+    ->Arg(0)
+    ->Arg(-1)
+    ->UseRealTime();
+
+void BM_ThreadPoolFixed(benchmark::State& state) {
+  ThreadPool pool{(int)state.range(0), 16};
+  std::vector<nanoseconds> times = JobTimes(kFixed);
+  std::atomic<int> num_done{0};
+  int num_submitted = 0;
+  for (auto _ : state) {
+    for (nanoseconds time : times) {
+      pool.Do([time, &num_done] {
+        Burn(time);
+        num_done.fetch_add(1, std::memory_order_release);
+      });
+    }
+    num_submitted += kBatchSize;
+    while (num_done.load(std::memory_order_acquire) < num_submitted) {
+      std::this_thread::yield();
+    }
+  }
+  state.SetItemsProcessed(num_submitted);
+}
+BENCHMARK(BM_ThreadPoolFixed)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+void BM_OrderedThreadPoolFixed(benchmark::State& state) {
+  OrderedThreadPool<int> pool{(int)state.range(0), 16};
+  std::vector<nanoseconds> times = JobTimes(kFixed);
+  for (auto _ : state) {
+    RunBatch(pool, times);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatchSize);
+}
+BENCHMARK(BM_OrderedThreadPoolFixed)
+    ->RangeMultiplier(2)
+    ->Range(1, 8)
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,61 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the mutex based and the lock-free JobQueue.
+//
+// Every thread pushes a job and pops a job in turn, so the queue never runs
+// empty or full and the numbers reflect only the cost of synchronization.
+// items_per_second counts both pushes and pops.
+
+#include <benchmark/benchmark.h>
+
+#include <memory>
+
+#include "../src/job_queue.h"
+
+namespace {
+
+std::unique_ptr<JobQueue<int>> queue;
+
+template <bool kLockFree>
+void CreateQueue(const benchmark::State&) {
+  queue = std::make_unique<JobQueue<int>>(1024, kLockFree);
+}
+
+void DestroyQueue(const benchmark::State&) { queue.reset(); }
+
+void BM_PushPop(benchmark::State& state) {
+  for (auto _ : state) {
+    queue->Push([] { return 1; });
+    benchmark::DoNotOptimize(queue->Pop());
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+
+BENCHMARK(BM_PushPop)
+    ->Name("MutexQueue")
+    ->Setup(CreateQueue<false>)
+    ->Teardown(DestroyQueue)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+BENCHMARK(BM_PushPop)
+    ->Name("LockFreeQueue")
+    ->Setup(CreateQueue<true>)
+    ->Teardown(DestroyQueue)
+    ->ThreadRange(1, 64)
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
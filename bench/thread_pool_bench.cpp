@@ -0,0 +1,80 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares ThreadPool with running the same fire-and-forget tasks through
+// OrderedThreadPool<int> and a no-op completion, which is how ThreadPool used
+// to be implemented.
+//
+// Each iteration submits a batch of empty tasks and waits for all of them to
+// run. The argument is the number of workers.
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <thread>
+
+#include "../src/ordered_thread_pool.h"
+#include "../src/thread_pool.h"
+
+namespace {
+
+constexpr int kBatchSize = 1000;
+
+void WaitFor(const std::atomic<int>& counter, int value) {
+  while (counter.load(std::memory_order_acquire) < value) {
+    std::this_thread::yield();
+  }
+}
+
+void BM_ThreadPool(benchmark::State& state) {
+  ThreadPool pool{(int)state.range(0), 0};
+  std::atomic<int> num_done{0};
+  int num_submitted = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < kBatchSize; ++i) {
+      pool.Do([&num_done] { num_done.fetch_add(1); });
+    }
+    num_submitted += kBatchSize;
+    WaitFor(num_done, num_submitted);
+  }
+  state.SetItemsProcessed(num_submitted);
+}
+BENCHMARK(BM_ThreadPool)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+void BM_OrderedThreadPoolNoOpCompletion(benchmark::State& state) {
+  OrderedThreadPool<int> pool{(int)state.range(0), 0};
+  std::atomic<int> num_done{0};
+  int num_submitted = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < kBatchSize; ++i) {
+      pool.Do(
+          [&num_done] {
+            num_done.fetch_add(1);
+            return 0;
+          },
+          [](int) {});
+    }
+    num_submitted += kBatchSize;
+    WaitFor(num_done, num_submitted);
+  }
+  state.SetItemsProcessed(num_submitted);
+}
+BENCHMARK(BM_OrderedThreadPoolNoOpCompletion)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,94 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the latency and the CPU cost of each WaitPolicy.
+//
+// RoundTrip submits one empty job at a time and waits for its completion, so
+// the time per iteration is the latency of waking up a worker and handing over
+// the ticket. SparseJobs leaves a gap after each job, during which idle workers
+// either sleep or burn CPU.
+//
+// The first argument picks the policy from kPolicies, the second is the number
+// of workers. cpu_us_per_job counts the CPU time of all threads of the
+// process.
+
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "../src/ordered_thread_pool.h"
+
+namespace {
+
+constexpr WaitPolicy kPolicies[] = {
+    // Park right away.
+    {},
+    {.spin_iterations = 2000},
+    {.spin_iterations = 2000, .yield_iterations = 100},
+    {.yield_iterations = 100},
+};
+constexpr const char* kPolicyNames[] = {"park", "spin", "spin_yield",
+                                        "yield"};
+
+double ProcessCpuMicros() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+template <class IdleFn>
+void RunJobs(benchmark::State& state, IdleFn idle) {
+  OrderedThreadPool<int> pool{
+      (int)state.range(1),
+      {.max_pending_jobs = 1, .wait_policy = kPolicies[state.range(0)]}};
+  std::atomic<int> num_done{0};
+  int num_submitted = 0;
+  double cpu_start = ProcessCpuMicros();
+  for (auto _ : state) {
+    pool.Do([] { return 0; }, [&num_done](int) { num_done.fetch_add(1); });
+    ++num_submitted;
+    while (num_done.load(std::memory_order_acquire) < num_submitted) {
+      CpuRelax();
+    }
+    idle();
+  }
+  state.counters["cpu_us_per_job"] =
+      (ProcessCpuMicros() - cpu_start) / num_submitted;
+  state.SetLabel(kPolicyNames[state.range(0)]);
+  state.SetItemsProcessed(num_submitted);
+}
+
+void BM_RoundTrip(benchmark::State& state) {
+  RunJobs(state, [] {});
+}
+BENCHMARK(BM_RoundTrip)
+    ->ArgsProduct({{0, 1, 2, 3}, {1, 4, 16}})
+    ->UseRealTime();
+
+void BM_SparseJobs(benchmark::State& state) {
+  RunJobs(state, [] {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  });
+}
+BENCHMARK(BM_SparseJobs)
+    ->ArgsProduct({{0, 1, 2, 3}, {1, 4, 16}})
+    ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,145 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the coroutine awaitables of the pools. Built as C++20.
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "ordered_thread_pool.h"
+#include "thread_pool.h"
+
+// A coroutine which starts right away and is not awaited by anyone.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+Detached RecordThread(OrderedThreadPool<int>& pool, std::thread::id* id) {
+  co_await pool.Schedule();
+  *id = std::this_thread::get_id();
+}
+
+TEST(CoroutineTest, ScheduleResumesOnWorker) {
+  std::thread::id id = std::this_thread::get_id();
+  {
+    OrderedThreadPool<int> pool{2};
+    RecordThread(pool, &id);
+  }
+  ASSERT_NE(id, std::this_thread::get_id());
+}
+
+TEST(CoroutineTest, ScheduleUnthreaded) {
+  std::thread::id id;
+  OrderedThreadPool<int> pool{0};
+  RecordThread(pool, &id);
+  ASSERT_EQ(id, std::this_thread::get_id());
+}
+
+Detached DeliverInOrder(OrderedThreadPool<int>& pool, int i,
+                        std::vector<int>* delivered) {
+  int k = co_await pool.Ordered([i] {
+    // Later jobs tend to finish first.
+    std::this_thread::sleep_for(std::chrono::microseconds((10 - i % 10) * 50));
+    return i;
+  });
+  delivered->push_back(k);
+}
+
+TEST(CoroutineTest, OrderedResumesInOrder) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 0},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .reorder_buffer = true}}) {
+    std::vector<int> delivered;
+    {
+      OrderedThreadPool<int> pool{4, options};
+      for (int i = 0; i < 100; ++i) {
+        DeliverInOrder(pool, i, &delivered);
+      }
+    }
+    ASSERT_EQ(delivered.size(), 100);
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(delivered[i], i);
+    }
+  }
+}
+
+Detached AddTwice(OrderedThreadPool<int>& pool, int i,
+                  std::atomic<int>* num_done) {
+  int k = co_await pool.Ordered([i] { return i; });
+  k = co_await pool.Ordered([k] { return k + 1; });
+  if (k == i + 1) ++*num_done;
+}
+
+// The second await submits from the resumed coroutine, on a worker. It must
+// not block on the full queue while the other workers wait for their turn.
+TEST(CoroutineTest, OrderedChained) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{},
+        OrderedThreadPoolOptions{.reorder_buffer = true},
+        OrderedThreadPoolOptions{.lock_free_queue = true},
+        OrderedThreadPoolOptions{.work_stealing = true}}) {
+    std::atomic<int> num_done{0};
+    {
+      OrderedThreadPool<int> pool{2, options};
+      for (int i = 0; i < 2000; ++i) {
+        AddTwice(pool, i, &num_done);
+      }
+      pool.WaitIdle();
+    }
+    ASSERT_EQ(num_done, 2000);
+  }
+}
+
+TEST(CoroutineTest, OrderedUnthreaded) {
+  std::vector<int> delivered;
+  OrderedThreadPool<int> pool{0};
+  for (int i = 0; i < 5; ++i) {
+    DeliverInOrder(pool, i, &delivered);
+  }
+  ASSERT_EQ(delivered, (std::vector<int>{0, 1, 2, 3, 4}));
+}
+
+Detached Count(ThreadPool& pool, std::atomic<int>* count) {
+  co_await pool.Schedule();
+  ++*count;
+}
+
+TEST(CoroutineTest, ThreadPoolSchedule) {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool{4, 0};
+    for (int i = 0; i < 100; ++i) {
+      Count(pool, &count);
+    }
+  }
+  ASSERT_EQ(count, 100);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
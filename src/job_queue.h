@@ -0,0 +1,661 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The queue of pending jobs shared between the producers and the workers of a
+// thread pool.
+//
+// Two implementations are available for the shared queue -
+// - A std::queue guarded by a mutex. Producers and workers wait on condition
+//   variables.
+// - A bounded lock-free ring (MpmcQueue). Producers and workers only take a
+//   mutex to park when the ring is full or empty, respectively.
+//
+// Optionally each worker also gets a work-stealing deque. Jobs pushed by a
+// worker go to its own deque, and jobs pushed from outside go to the shared
+// queue. A worker looks for a job in its own deque first, then in the shared
+// queue, moving a batch of jobs to its deque, and finally steals from the
+// deques of the other workers.
+//
+// Workers never wait for room in the queue when they push, since they would
+// wait for themselves. Their jobs may then exceed the limit on pending jobs.
+//
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <type_traits>
+#include <vector>
+
+#include "mpmc_queue.h"
+#include "wait_policy.h"
+#include "work_stealing_deque.h"
+
+template <class Job>
+class JobQueue {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Capacity of the lock-free ring when no limit on pending jobs is requested.
+  static constexpr int kDefaultLockFreeCapacity = 1024;
+  // Most jobs a worker moves from the shared queue to its deque at once.
+  static constexpr int kMaxStealBatch = 32;
+
+  /**
+   * Instantiates an empty queue.
+   *
+   * @param max_pending_jobs Push() blocks while this many jobs are queued. A
+   *   value of 0 removes the limit, except for the lock-free ring which then
+   *   holds kDefaultLockFreeCapacity jobs.
+   * @param lock_free If true, uses a lock-free ring with room for
+   *   max_pending_jobs rounded up to a power of two.
+   * @param num_stealing_workers If positive, gives this many workers a
+   *   work-stealing deque each. Pop() must then be passed the index of the
+   *   calling worker.
+   * @param wait_policy How producers and workers wait before parking.
+   **/
+  JobQueue(int max_pending_jobs, bool lock_free, int num_stealing_workers = 0,
+           WaitPolicy wait_policy = {})
+      // With work stealing, the limit applies to all deques and the shared
+      // queue together, and is enforced through pending_.
+      : max_queue_size_(num_stealing_workers > 0 ? 0 : max_pending_jobs),
+        max_pending_(max_pending_jobs),
+        wait_policy_(wait_policy) {
+    if (lock_free) {
+      ring_ = std::make_unique<MpmcQueue<Job>>(
+          max_pending_jobs > 0 ? max_pending_jobs : kDefaultLockFreeCapacity);
+    }
+    for (int i = 0; i < num_stealing_workers; ++i) {
+      deques_.push_back(std::make_unique<WorkStealingDeque<Job*>>());
+    }
+  }
+
+  ~JobQueue() {
+    for (auto& deque : deques_) {
+      while (std::optional<Job*> job = deque->Pop()) {
+        delete *job;
+      }
+    }
+  }
+
+  /**
+   * Enqueues make_job(), blocking while the queue is full, unless called from
+   * a worker of this queue.
+   *
+   * With the mutex based queue make_job() is called under the lock, so that
+   * jobs are dequeued in the order of the calls to make_job(). This does not
+   * hold with work stealing.
+   **/
+  template <class MakeJobFn>
+  void Push(MakeJobFn&& make_job) {
+    PushBatch(1, [&make_job](size_t) { return make_job(); });
+  }
+
+  /**
+   * Enqueues make_job(0), ..., make_job(count - 1) in that order, blocking
+   * while the queue is full.
+   *
+   * As many jobs as there is room for are pushed under one lock, and waiting
+   * workers are woken up once for all of them. The order guarantee of Push()
+   * holds for the calls to make_job().
+   **/
+  template <class MakeJobFn>
+  void PushBatch(size_t count, MakeJobFn&& make_job) {
+    size_t index = 0;
+    auto make_next = [&make_job, &index] { return make_job(index++); };
+    if (deques_.empty()) {
+      PushShared(count, make_next);
+      return;
+    }
+    if (CalledFromWorker()) {
+      // Called from a job. Keep the new jobs close to this worker.
+      pending_.fetch_add(count);
+      for (size_t i = 0; i < count; ++i) {
+        deques_[local_.worker]->Push(new Job(make_next()));
+      }
+      Unpark(waiting_consumers_, not_empty_, count > 1);
+      return;
+    }
+    while (count > 0) {
+      size_t reserved;
+      while ((reserved = TryReserve(count)) == 0) {
+        Park(waiting_producers_, not_full_,
+             [this] { return pending_.load() < max_pending_; });
+      }
+      PushShared(reserved, make_next);
+      count -= reserved;
+    }
+  }
+
+  // Converts a deadline on another clock, e.g. std::chrono::system_clock, for
+  // PushUntil().
+  template <class OtherClock, class Duration>
+  static Clock::time_point ToClock(
+      const std::chrono::time_point<OtherClock, Duration>& deadline) {
+    if constexpr (std::is_same_v<OtherClock, Clock>) {
+      return std::chrono::time_point_cast<Clock::duration>(deadline);
+    } else {
+      return Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                deadline - OtherClock::now());
+    }
+  }
+
+  /**
+   * Like Push(), but gives up once deadline has passed. make_job() is only
+   * called if the job is pushed.
+   *
+   * @return False if the queue stayed full till the deadline.
+   **/
+  template <class MakeJobFn>
+  bool PushUntil(Clock::time_point deadline, MakeJobFn&& make_job) {
+    bool stealing = !deques_.empty();
+    if (stealing) {
+      while (TryReserve(1) == 0) {
+        if (!Park(
+                waiting_producers_, not_full_,
+                [this] { return pending_.load() < max_pending_; }, deadline)) {
+          return false;
+        }
+      }
+      if (CalledFromWorker()) {
+        deques_[local_.worker]->Push(new Job(make_job()));
+        Unpark(waiting_consumers_, not_empty_);
+        return true;
+      }
+    }
+    if (ring_) {
+      while (!(RingHasRoom() && ring_->TryPushWith(make_job))) {
+        if (!Park(
+                waiting_producers_, not_full_,
+                [this] { return RingHasRoom(); }, deadline)) {
+          if (stealing) pending_.fetch_sub(1);
+          return false;
+        }
+      }
+      Unpark(waiting_consumers_, not_empty_);
+      return true;
+    }
+    // With work stealing the mutex based queue is unbounded, so the wait below
+    // only happens without it.
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (!HasRoomLocked()) {
+      if (Clock::now() >= deadline) {
+        return false;
+      }
+      if (wait_policy_.Spins()) {
+        lck.unlock();
+        SpinUntil(wait_policy_, [this] { return HasRoom(); });
+        lck.lock();
+      }
+      if (!not_full_.wait_until(lck, deadline,
+                                [this] { return HasRoomLocked(); })) {
+        return false;
+      }
+    }
+    queue_.push(make_job());
+    queue_size_.store(queue_.size(), std::memory_order_relaxed);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Blocks till a job is available. Returns empty once Close() was called and
+   * all jobs have been handed out. The calling thread counts as a worker of
+   * this queue from then on.
+   *
+   * @param worker Index of the calling worker. Only used with work stealing.
+   * @param deadline If set, also returns empty once this has passed without a
+   *   job.
+   **/
+  std::optional<Job> Pop(int worker = 0,
+                         std::optional<Clock::time_point> deadline = {}) {
+    local_ = WorkerSlot{this, worker};
+    if (!deques_.empty()) {
+      return PopStealing(worker, deadline);
+    }
+    if (ring_) {
+      while (true) {
+        std::optional<Job> job = ring_->TryPop();
+        if (job.has_value()) {
+          Unpark(waiting_producers_, not_full_);
+          return job;
+        }
+        if (queue_size_.load(std::memory_order_relaxed) > 0) {
+          std::lock_guard<std::mutex> lck(mtx_);
+          if (!queue_.empty()) {
+            job = std::move(queue_.front());
+            queue_.pop();
+            queue_size_.store(queue_.size(), std::memory_order_relaxed);
+            return job;
+          }
+        }
+        if (closed_ && ring_->Empty() &&
+            queue_size_.load(std::memory_order_relaxed) == 0) {
+          return {};
+        }
+        if (!Park(
+                waiting_consumers_, not_empty_,
+                [this] {
+                  return !ring_->Empty() ||
+                         queue_size_.load(std::memory_order_relaxed) > 0 ||
+                         closed_;
+                },
+                deadline)) {
+          return {};
+        }
+      }
+    }
+    SpinUntil(wait_policy_, [this] {
+      return queue_size_.load(std::memory_order_relaxed) > 0 || closed_;
+    });
+    std::unique_lock<std::mutex> lck(mtx_);
+    auto ready = [this] { return !queue_.empty() || closed_; };
+    if (deadline.has_value()) {
+      not_empty_.wait_until(lck, *deadline, ready);
+    } else {
+      not_empty_.wait(lck, ready);
+    }
+    // If requested to terminate, the entire queue is finished before this.
+    // Otherwise the deadline has passed.
+    if (queue_.empty()) {
+      return {};
+    }
+    Job result = std::move(queue_.front());
+    queue_.pop();
+    queue_size_.store(queue_.size(), std::memory_order_relaxed);
+    not_full_.notify_one();
+    return result;
+  }
+
+  /**
+   * Changes the limit on pending jobs given to the constructor. Producers
+   * blocked on the old limit are woken up if it was raised.
+   *
+   * The lock-free ring does not grow, so with it the limit is capped at its
+   * capacity.
+   **/
+  void SetMaxPending(int max_pending_jobs) {
+    if (!deques_.empty()) {
+      max_pending_.store(max_pending_jobs);
+    } else if (ring_) {
+      ring_limit_.store(max_pending_jobs);
+    } else {
+      max_queue_size_.store(max_pending_jobs);
+    }
+    std::lock_guard<std::mutex> lck(mtx_);
+    not_full_.notify_all();
+  }
+
+  /**
+   * Takes a job from the deque of the calling worker only, without waiting.
+   * Lets a worker which is about to exit finish the jobs it pushed.
+   **/
+  std::optional<Job> PopOwn(int worker) {
+    if (deques_.empty()) {
+      return {};
+    }
+    std::optional<Job*> job = deques_[worker]->Pop();
+    if (!job.has_value()) {
+      return {};
+    }
+    pending_.fetch_sub(1);
+    Unpark(waiting_producers_, not_full_);
+    return Take(*job);
+  }
+
+  /**
+   * Puts back a job taken by PopOwn() into the shared queue, so that another
+   * worker takes it. Does not wait for room within the limit on pending jobs,
+   * since the job was counted before.
+   **/
+  void Requeue(Job job) {
+    pending_.fetch_add(1);
+    auto make_next = [&job] { return std::move(job); };
+    PushShared(1, make_next);
+  }
+
+  // Number of work-stealing deques, and hence the most workers which may call
+  // Pop() at once with work stealing. 0 without work stealing.
+  int num_deques() const { return deques_.size(); }
+
+  // True once Close() was called.
+  bool closed() const { return closed_; }
+
+  // True if the calling thread has popped from this queue, i.e. is one of its
+  // workers.
+  bool CalledFromWorker() const { return local_.queue == this; }
+
+  // Number of jobs pushed and not yet popped. Read without locking, so only
+  // approximate while jobs are pushed or popped.
+  size_t Size() const {
+    if (!deques_.empty()) {
+      return std::max(0, pending_.load(std::memory_order_relaxed));
+    }
+    if (ring_) {
+      return ring_->Size() + queue_size_.load(std::memory_order_relaxed);
+    }
+    return queue_size_.load(std::memory_order_relaxed);
+  }
+
+  // Wakes up all waiting workers. Pop() keeps handing out the remaining jobs,
+  // and then returns empty.
+  void Close() {
+    // Notify holding the lock.
+    // This prevents missing a notification if this executes inbetween when
+    // the wait() checks the predicate to be false and relocks.
+    std::lock_guard<std::mutex> lck(mtx_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  // Identifies the worker running on this thread, if any.
+  struct WorkerSlot {
+    const JobQueue* queue = nullptr;
+    int worker = 0;
+  };
+
+  // Pushes count jobs from make_next() to the shared queue, blocking while it
+  // is full unless called from a worker.
+  template <class MakeNextFn>
+  void PushShared(size_t count, MakeNextFn& make_next) {
+    const bool from_worker = CalledFromWorker();
+    if (ring_) {
+      size_t pushed = 0;
+      while (pushed < count) {
+        if (RingHasRoom() && ring_->TryPushWith(make_next)) {
+          ++pushed;
+          continue;
+        }
+        if (from_worker) {
+          // The ring does not grow. Keep the rest in queue_ instead.
+          std::lock_guard<std::mutex> lck(mtx_);
+          for (; pushed < count; ++pushed) {
+            queue_.push(make_next());
+          }
+          queue_size_.store(queue_.size(), std::memory_order_relaxed);
+          break;
+        }
+        // Let the workers drain what was pushed so far before parking.
+        Unpark(waiting_consumers_, not_empty_, pushed > 1);
+        Park(waiting_producers_, not_full_, [this] { return RingHasRoom(); });
+      }
+      Unpark(waiting_consumers_, not_empty_, count > 1);
+      return;
+    }
+    std::unique_lock<std::mutex> lck(mtx_);
+    while (count > 0) {
+      if (!from_worker) {
+        if (!HasRoomLocked() && wait_policy_.Spins()) {
+          // Spin without the lock, so that the workers can make room.
+          lck.unlock();
+          SpinUntil(wait_policy_, [this] { return HasRoom(); });
+          lck.lock();
+        }
+        not_full_.wait(lck, [this] { return HasRoomLocked(); });
+      }
+      int max_size = max_queue_size_.load(std::memory_order_relaxed);
+      size_t room =
+          from_worker || max_size == 0
+              ? count
+              : std::min<size_t>(
+                    count, std::max<int>(1, max_size - (int)queue_.size()));
+      for (size_t i = 0; i < room; ++i) {
+        queue_.push(make_next());
+      }
+      queue_size_.store(queue_.size(), std::memory_order_relaxed);
+      count -= room;
+      if (room > 1) {
+        not_empty_.notify_all();
+      } else {
+        not_empty_.notify_one();
+      }
+    }
+  }
+
+  std::optional<Job> PopStealing(int worker,
+                                 std::optional<Clock::time_point> deadline) {
+    Backoff backoff{wait_policy_};
+    while (true) {
+      std::optional<Job> job = TryPopStealing(worker);
+      if (job.has_value()) {
+        pending_.fetch_sub(1);
+        if (max_pending_ > 0) {
+          Unpark(waiting_producers_, not_full_);
+        }
+        return job;
+      }
+      if (!closed_ && backoff.Pause()) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lck(mtx_);
+      waiting_consumers_.fetch_add(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      auto ready = [this] { return closed_ || HasQueuedLocked(); };
+      if (deadline.has_value()) {
+        not_empty_.wait_until(lck, *deadline, ready);
+      } else {
+        not_empty_.wait(lck, ready);
+      }
+      waiting_consumers_.fetch_sub(1, std::memory_order_relaxed);
+      if (!HasQueuedLocked()) {
+        // Closed or timed out, and nothing left anywhere.
+        return {};
+      }
+    }
+  }
+
+  // Looks for a job in the worker's own deque, then in the shared queue, and
+  // then in the other deques.
+  std::optional<Job> TryPopStealing(int worker) {
+    WorkStealingDeque<Job*>& own = *deques_[worker];
+    if (std::optional<Job*> job = own.Pop()) {
+      return Take(*job);
+    }
+    std::optional<Job> result;
+    bool kept_extra = false;
+    TakeShared([&](Job&& job) {
+      if (!result.has_value()) {
+        result = std::move(job);
+      } else {
+        own.Push(new Job(std::move(job)));
+        kept_extra = true;
+      }
+    });
+    if (kept_extra) {
+      // Let idle workers steal the rest of the batch.
+      Unpark(waiting_consumers_, not_empty_);
+    }
+    if (result.has_value()) {
+      return result;
+    }
+    for (size_t i = 1; i < deques_.size(); ++i) {
+      WorkStealingDeque<Job*>& victim = *deques_[(worker + i) % deques_.size()];
+      if (std::optional<Job*> job = victim.Steal()) {
+        return Take(*job);
+      }
+    }
+    return {};
+  }
+
+  // Passes a fair share of the shared queue to sink, with a single lock if the
+  // queue is mutex based.
+  template <class SinkFn>
+  void TakeShared(SinkFn sink) {
+    int batch = 0;
+    if (ring_) {
+      batch = BatchSize(ring_->Size());
+      for (; batch > 0; --batch) {
+        std::optional<Job> job = ring_->TryPop();
+        if (!job.has_value()) break;
+        sink(std::move(*job));
+      }
+      Unpark(waiting_producers_, not_full_);
+      if (batch == 0 || queue_size_.load(std::memory_order_relaxed) == 0) {
+        return;
+      }
+    }
+    std::lock_guard<std::mutex> lck(mtx_);
+    if (!ring_) {
+      batch = BatchSize(queue_.size());
+    }
+    for (int i = 0; i < batch && !queue_.empty(); ++i) {
+      sink(std::move(queue_.front()));
+      queue_.pop();
+    }
+    queue_size_.store(queue_.size(), std::memory_order_relaxed);
+  }
+
+  int BatchSize(size_t queue_size) const {
+    return 1 + std::min<int>(kMaxStealBatch - 1,
+                             queue_size / deques_.size());
+  }
+
+  static Job Take(Job* job) {
+    Job result = std::move(*job);
+    delete job;
+    return result;
+  }
+
+  // Counts up to count new jobs towards max_pending_, as many as there is room
+  // for. Returns the number counted, which is 0 if there was no room.
+  size_t TryReserve(size_t count) {
+    int pending = pending_.load();
+    int max_pending = max_pending_.load(std::memory_order_relaxed);
+    while (max_pending == 0 || pending < max_pending) {
+      size_t reserved =
+          max_pending == 0 ? count
+                           : std::min<size_t>(count, max_pending - pending);
+      if (pending_.compare_exchange_weak(pending, pending + (int)reserved)) {
+        return reserved;
+      }
+    }
+    return 0;
+  }
+
+  // Whether the mutex based queue has room for another job. Must hold mtx_.
+  bool HasRoomLocked() const {
+    int max_size = max_queue_size_.load(std::memory_order_relaxed);
+    return max_size == 0 || (int)queue_.size() < max_size;
+  }
+
+  // Like HasRoomLocked(), without the lock, for spinning.
+  bool HasRoom() const {
+    int max_size = max_queue_size_.load(std::memory_order_relaxed);
+    return max_size == 0 ||
+           (int)queue_size_.load(std::memory_order_relaxed) < max_size;
+  }
+
+  // Whether the ring has room, within the limit set by SetMaxPending().
+  bool RingHasRoom() const {
+    int limit = ring_limit_.load(std::memory_order_relaxed);
+    return limit == 0 ? !ring_->Full() : (int)ring_->Size() < limit;
+  }
+
+  // Whether any job is queued anywhere. Must hold mtx_.
+  bool HasQueuedLocked() const {
+    if (!queue_.empty() || (ring_ && !ring_->Empty())) {
+      return true;
+    }
+    for (const auto& deque : deques_) {
+      if (deque->Size() > 0) return true;
+    }
+    return false;
+  }
+
+  // Spins as per wait_policy_, and then sleeps on cv, till ready() holds or
+  // the deadline, if any, has passed. Returns whether ready() holds. The
+  // caller must have found the ring full or empty without holding the lock;
+  // waiters is raised before ready() is checked again, so that Unpark() by the
+  // other side is not missed.
+  template <class ReadyFn>
+  bool Park(std::atomic<int>& waiters, std::condition_variable& cv,
+            ReadyFn ready, std::optional<Clock::time_point> deadline = {}) {
+    if (deadline.has_value() && Clock::now() >= *deadline) {
+      // Already late, as with TryDo(). Do not spin.
+      return ready();
+    }
+    if (SpinUntil(wait_policy_, ready)) {
+      return true;
+    }
+    std::unique_lock<std::mutex> lck(mtx_);
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool is_ready = true;
+    if (deadline.has_value()) {
+      is_ready = cv.wait_until(lck, *deadline, ready);
+    } else {
+      cv.wait(lck, ready);
+    }
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return is_ready;
+  }
+
+  // Wakes up one thread parked on cv, or all of them if all is set. Cheap when
+  // there are none, since it does not take the lock.
+  void Unpark(std::atomic<int>& waiters, std::condition_variable& cv,
+              bool all = false) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_seq_cst) > 0) {
+      std::lock_guard<std::mutex> lck(mtx_);
+      if (all) {
+        cv.notify_all();
+      } else {
+        cv.notify_one();
+      }
+    }
+  }
+
+  // Queue of jobs. With ring_, only holds the jobs pushed by workers while the
+  // ring was full.
+  std::queue<Job> queue_;
+  std::atomic<int> max_queue_size_;
+  // Size of queue_, for spinning without the lock.
+  std::atomic<size_t> queue_size_{0};
+  // Lock-free replacement of queue_.
+  std::unique_ptr<MpmcQueue<Job>> ring_;
+  // Limit on the jobs in ring_ below its capacity, if not 0.
+  std::atomic<int> ring_limit_{0};
+
+  // One deque per worker, if work stealing is enabled.
+  std::vector<std::unique_ptr<WorkStealingDeque<Job*>>> deques_;
+  // With work stealing, the number of jobs in the deques and the shared queue
+  // together, and its limit.
+  std::atomic<int> pending_{0};
+  std::atomic<int> max_pending_;
+  const WaitPolicy wait_policy_;
+  static inline thread_local WorkerSlot local_;
+
+  // Guards queue_. With ring_ or deques_, also used for parking.
+  std::mutex mtx_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  // Number of threads parked on not_empty_ and not_full_ outside of the
+  // mutex based queue.
+  std::atomic<int> waiting_consumers_{0};
+  std::atomic<int> waiting_producers_{0};
+
+  // If true, the workers should stop once the queue is empty.
+  std::atomic<bool> closed_{false};
+};
+
+#endif  // JOB_QUEUE_H
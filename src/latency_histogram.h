@@ -0,0 +1,167 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A histogram of latencies with log-linear buckets, in the style of
+// HdrHistogram.
+//
+// Each power of two of nanoseconds is split into kSubBuckets buckets of equal
+// width, so a value is known to within 1/kSubBuckets of itself over the whole
+// range of int64 nanoseconds, in a fixed array of counters. Recording is
+// lock-free and does not allocate. Histograms recorded by different threads
+// are combined with Merge().
+//
+// Example -
+//
+//   LatencyHistogram histogram;
+//   histogram.Record(end - start);
+//   ...
+//   std::chrono::nanoseconds p99 = histogram.Percentile(99);
+//
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  // Values below kSubBuckets get a bucket each. Above, each of the remaining
+  // powers of two up to 2^63 gets kSubBuckets.
+  static constexpr size_t kNumBuckets =
+      (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  LatencyHistogram() = default;
+
+  // Copies a snapshot of other, which may be recorded to meanwhile.
+  LatencyHistogram(const LatencyHistogram& other) { Merge(other); }
+  LatencyHistogram& operator=(const LatencyHistogram& other) {
+    if (this != &other) {
+      Clear();
+      Merge(other);
+    }
+    return *this;
+  }
+
+  /**
+   * Counts a latency. Safe to call concurrently, but cheapest when only one
+   * thread records to each histogram.
+   *
+   * @param latency Negative values count as 0.
+   **/
+  void Record(std::chrono::nanoseconds latency) {
+    uint64_t ns = latency.count() > 0 ? latency.count() : 0;
+    counts_[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  // Adds the counts of other to this.
+  void Merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      uint64_t count = other.counts_[i].load(std::memory_order_relaxed);
+      if (count > 0) counts_[i].fetch_add(count, std::memory_order_relaxed);
+    }
+    sum_ns_.fetch_add(other.sum_ns_.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+  }
+
+  void Clear() {
+    for (std::atomic<uint64_t>& count : counts_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    sum_ns_.store(0, std::memory_order_relaxed);
+  }
+
+  // Number of latencies recorded.
+  uint64_t count() const {
+    uint64_t total = 0;
+    for (const std::atomic<uint64_t>& count : counts_) {
+      total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  // Average of the latencies recorded, or 0 if there are none.
+  std::chrono::nanoseconds Mean() const {
+    uint64_t total = count();
+    if (total == 0) return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(
+        (int64_t)(sum_ns_.load(std::memory_order_relaxed) / total));
+  }
+
+  /**
+   * Returns the latency which percentile percent of the recorded latencies do
+   * not exceed, rounded up to the end of its bucket. 0 if nothing is recorded.
+   *
+   * @param percentile Between 0 and 100, e.g. 99.9.
+   **/
+  std::chrono::nanoseconds Percentile(double percentile) const {
+    uint64_t total = count();
+    if (total == 0) return std::chrono::nanoseconds(0);
+    uint64_t rank = (uint64_t)std::ceil(percentile / 100 * total);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank) return std::chrono::nanoseconds(BucketEnd(i));
+    }
+    // Only reached if counts were added since count() was read.
+    return std::chrono::nanoseconds(BucketEnd(kNumBuckets - 1));
+  }
+
+  std::chrono::nanoseconds Max() const { return Percentile(100); }
+
+  // Index of the bucket counting ns.
+  static size_t BucketOf(uint64_t ns) {
+    if (ns < (uint64_t)kSubBuckets) return ns;
+    int exponent = 63 - CountLeadingZeros(ns);
+    int shift = exponent - kSubBucketBits;
+    return (size_t)(shift + 1) * kSubBuckets +
+           ((ns >> shift) - kSubBuckets);
+  }
+
+  // The largest value counted by bucket.
+  static int64_t BucketEnd(size_t bucket) {
+    if (bucket < (size_t)kSubBuckets) return bucket;
+    int shift = bucket / kSubBuckets - 1;
+    uint64_t start = (uint64_t)(kSubBuckets + bucket % kSubBuckets) << shift;
+    uint64_t end = start + (uint64_t(1) << shift) - 1;
+    return end > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)end;
+  }
+
+ private:
+  // value must not be 0.
+  static int CountLeadingZeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+#else
+    int count = 0;
+    for (uint64_t bit = uint64_t(1) << 63; (value & bit) == 0; bit >>= 1) {
+      ++count;
+    }
+    return count;
+#endif
+  }
+
+  std::atomic<uint64_t> counts_[kNumBuckets] = {};
+  std::atomic<uint64_t> sum_ns_{0};
+};
+
+#endif  // LATENCY_HISTOGRAM_H
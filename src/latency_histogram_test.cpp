@@ -0,0 +1,79 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "latency_histogram.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+
+using std::chrono::nanoseconds;
+
+TEST(LatencyHistogramTest, Buckets) {
+  // Exact below kSubBuckets.
+  for (uint64_t ns = 0; ns < LatencyHistogram::kSubBuckets; ++ns) {
+    ASSERT_EQ(LatencyHistogram::BucketOf(ns), ns);
+    ASSERT_EQ(LatencyHistogram::BucketEnd(ns), (int64_t)ns);
+  }
+  // Every value falls within its bucket, and buckets are contiguous.
+  size_t last_bucket = LatencyHistogram::kSubBuckets - 1;
+  for (uint64_t ns = LatencyHistogram::kSubBuckets; ns < 100000; ++ns) {
+    size_t bucket = LatencyHistogram::BucketOf(ns);
+    ASSERT_GE(LatencyHistogram::BucketEnd(bucket), (int64_t)ns);
+    if (bucket != last_bucket) {
+      ASSERT_EQ(bucket, last_bucket + 1);
+      ASSERT_EQ(LatencyHistogram::BucketEnd(last_bucket), (int64_t)ns - 1);
+      last_bucket = bucket;
+    }
+  }
+  ASSERT_EQ(LatencyHistogram::BucketOf(UINT64_MAX),
+            LatencyHistogram::kNumBuckets - 1);
+}
+
+TEST(LatencyHistogramTest, Percentile) {
+  LatencyHistogram histogram;
+  ASSERT_EQ(histogram.Percentile(99).count(), 0);
+  for (int i = 1; i <= 1000; ++i) {
+    histogram.Record(std::chrono::microseconds(i));
+  }
+  ASSERT_EQ(histogram.count(), 1000);
+  ASSERT_NEAR(histogram.Mean().count(), 500500, 1);
+  // Within a bucket width, 1/16 of the value.
+  ASSERT_NEAR(histogram.Percentile(50).count(), 500000, 500000 / 16);
+  ASSERT_NEAR(histogram.Percentile(99).count(), 990000, 990000 / 16);
+  ASSERT_GE(histogram.Max().count(), 1000000);
+  ASSERT_NEAR(histogram.Percentile(0).count(), 1000, 1000 / 16);
+}
+
+TEST(LatencyHistogramTest, Merge) {
+  LatencyHistogram a;
+  LatencyHistogram b;
+  a.Record(nanoseconds(5));
+  b.Record(nanoseconds(7));
+  b.Record(nanoseconds(-3));
+  LatencyHistogram merged = a;
+  merged.Merge(b);
+  ASSERT_EQ(merged.count(), 3);
+  ASSERT_EQ(merged.Percentile(34).count(), 5);
+  ASSERT_EQ(merged.Max().count(), 7);
+  ASSERT_EQ(a.count(), 1);
+  merged.Clear();
+  ASSERT_EQ(merged.count(), 0);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
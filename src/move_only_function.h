@@ -0,0 +1,176 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A move-only replacement of std::function, similar to C++23's
+// std::move_only_function.
+//
+// Differences from std::function -
+// - Accepts callables which cannot be copied, e.g. lambdas capturing a
+//   std::unique_ptr.
+// - Stores callables of up to kInlineSize bytes without allocating. Moving
+//   such a function moves the callable, and never allocates either.
+//
+// Example -
+//
+//   auto data = std::make_unique<Data>();
+//   MoveOnlyFunction<int()> fn = [data = std::move(data)] { return Use(*data); };
+//   MoveOnlyFunction<int()> other = std::move(fn);
+//   other();
+//
+#ifndef MOVE_ONLY_FUNCTION_H
+#define MOVE_ONLY_FUNCTION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <class Signature>
+class MoveOnlyFunction;
+
+template <class R, class... Args>
+class MoveOnlyFunction<R(Args...)> {
+ public:
+  // Callables up to this size are stored without a heap allocation.
+  static constexpr size_t kInlineSize = 6 * sizeof(void*);
+
+  MoveOnlyFunction() = default;
+  MoveOnlyFunction(std::nullptr_t) {}
+
+  template <class F,
+            class = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, MoveOnlyFunction> &&
+                std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  MoveOnlyFunction(F&& fn) {
+    using Fn = std::decay_t<F>;
+    if constexpr (std::is_pointer_v<Fn> || std::is_member_pointer_v<Fn> ||
+                  IsStdFunction<Fn>::value) {
+      if (!fn) return;
+    }
+    if constexpr (kStoredInline<Fn>) {
+      new (storage_) Fn(std::forward<F>(fn));
+      vtable_ = &kInlineVTable<Fn>;
+    } else {
+      new (storage_) Fn*(new Fn(std::forward<F>(fn)));
+      vtable_ = &kHeapVTable<Fn>;
+    }
+  }
+
+  MoveOnlyFunction(MoveOnlyFunction&& other) noexcept
+      : vtable_(other.vtable_) {
+    if (vtable_ != nullptr) {
+      vtable_->move(storage_, other.storage_);
+      other.vtable_ = nullptr;
+    }
+  }
+
+  MoveOnlyFunction& operator=(MoveOnlyFunction&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      vtable_ = other.vtable_;
+      if (vtable_ != nullptr) {
+        vtable_->move(storage_, other.storage_);
+        other.vtable_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  MoveOnlyFunction& operator=(std::nullptr_t) {
+    Reset();
+    return *this;
+  }
+
+  MoveOnlyFunction(const MoveOnlyFunction&) = delete;
+  MoveOnlyFunction& operator=(const MoveOnlyFunction&) = delete;
+
+  ~MoveOnlyFunction() { Reset(); }
+
+  explicit operator bool() const { return vtable_ != nullptr; }
+
+  // Like std::function, this is const even if the callable is not.
+  R operator()(Args... args) const {
+    return vtable_->invoke(const_cast<unsigned char*>(storage_),
+                           std::forward<Args>(args)...);
+  }
+
+ private:
+  struct VTable {
+    R (*invoke)(void* storage, Args&&... args);
+    // Move constructs the callable at dst from src, and destroys src.
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void* storage);
+  };
+
+  template <class T>
+  struct IsStdFunction : std::false_type {};
+  template <class T>
+  struct IsStdFunction<std::function<T>> : std::true_type {};
+
+  template <class Fn>
+  static constexpr bool kStoredInline =
+      sizeof(Fn) <= kInlineSize &&
+      alignof(Fn) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<Fn>;
+
+  template <class Fn>
+  static R Invoke(Fn& fn, Args&&... args) {
+    if constexpr (std::is_void_v<R>) {
+      std::invoke(fn, std::forward<Args>(args)...);
+    } else {
+      return std::invoke(fn, std::forward<Args>(args)...);
+    }
+  }
+
+  template <class Fn>
+  static constexpr VTable kInlineVTable = {
+      [](void* storage, Args&&... args) -> R {
+        return Invoke(*std::launder(static_cast<Fn*>(storage)),
+                      std::forward<Args>(args)...);
+      },
+      [](void* dst, void* src) {
+        Fn* fn = std::launder(static_cast<Fn*>(src));
+        new (dst) Fn(std::move(*fn));
+        fn->~Fn();
+      },
+      [](void* storage) { std::launder(static_cast<Fn*>(storage))->~Fn(); },
+  };
+
+  template <class Fn>
+  static constexpr VTable kHeapVTable = {
+      [](void* storage, Args&&... args) -> R {
+        return Invoke(**static_cast<Fn**>(storage),
+                      std::forward<Args>(args)...);
+      },
+      [](void* dst, void* src) {
+        new (dst) Fn*(*static_cast<Fn**>(src));
+      },
+      [](void* storage) { delete *static_cast<Fn**>(storage); },
+  };
+
+  void Reset() {
+    if (vtable_ != nullptr) {
+      vtable_->destroy(storage_);
+      vtable_ = nullptr;
+    }
+  }
+
+  const VTable* vtable_ = nullptr;
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+};
+
+#endif  // MOVE_ONLY_FUNCTION_H
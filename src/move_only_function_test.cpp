@@ -0,0 +1,101 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "move_only_function.h"
+
+#include <gtest/gtest.h>
+
+#include <array>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+// Counts heap allocations made by this test binary.
+static int num_allocations = 0;
+
+void* operator new(size_t size) {
+  ++num_allocations;
+  if (void* ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+TEST(MoveOnlyFunctionTest, Empty) {
+  MoveOnlyFunction<int()> fn;
+  ASSERT_FALSE(fn);
+  MoveOnlyFunction<int()> from_null = nullptr;
+  ASSERT_FALSE(from_null);
+  MoveOnlyFunction<int()> from_empty_function = std::function<int()>{};
+  ASSERT_FALSE(from_empty_function);
+}
+
+TEST(MoveOnlyFunctionTest, MoveOnlyCapture) {
+  auto value = std::make_unique<int>(5);
+  MoveOnlyFunction<int(int)> fn = [value = std::move(value)](int k) {
+    return *value + k;
+  };
+  ASSERT_EQ(fn(1), 6);
+  MoveOnlyFunction<int(int)> moved = std::move(fn);
+  ASSERT_FALSE(fn);
+  ASSERT_EQ(moved(2), 7);
+}
+
+// Small callables must not touch the heap, neither when stored nor when moved.
+TEST(MoveOnlyFunctionTest, SmallCaptureDoesNotAllocate) {
+  int a = 1, b = 2, c = 3;
+  int before = num_allocations;
+  MoveOnlyFunction<int()> fn = [&a, &b, c] { return a + b + c; };
+  MoveOnlyFunction<int()> moved = std::move(fn);
+  MoveOnlyFunction<int()> assigned;
+  assigned = std::move(moved);
+  ASSERT_EQ(assigned(), 6);
+  ASSERT_EQ(num_allocations, before);
+}
+
+TEST(MoveOnlyFunctionTest, LargeCapture) {
+  std::array<int, 64> values;
+  values.fill(1);
+  auto counter = std::make_shared<int>(0);
+  {
+    MoveOnlyFunction<int()> fn = [values, counter] {
+      ++*counter;
+      return values[63];
+    };
+    MoveOnlyFunction<int()> moved = std::move(fn);
+    ASSERT_EQ(moved(), 1);
+    ASSERT_EQ(*counter, 1);
+    ASSERT_EQ(counter.use_count(), 2);
+  }
+  // The callable was destroyed exactly once.
+  ASSERT_EQ(counter.use_count(), 1);
+}
+
+TEST(MoveOnlyFunctionTest, DiscardsResultForVoid) {
+  int calls = 0;
+  MoveOnlyFunction<void(int)> fn = [&calls](const int& k) {
+    calls += k;
+    return calls;
+  };
+  fn(3);
+  ASSERT_EQ(calls, 3);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
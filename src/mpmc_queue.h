@@ -0,0 +1,185 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A bounded lock-free multi-producer multi-consumer queue.
+//
+// Each cell of the ring carries a sequence number, which tells producers and
+// consumers whose turn it is to use the cell. A push or pop is a single CAS on
+// the respective position counter followed by a store to the cell. Neither
+// operation ever blocks; TryPush() fails when full and TryPop() fails when
+// empty, and it is up to the caller to decide how to wait.
+//
+// Example -
+//
+//   MpmcQueue<int> queue{1024};
+//   queue.TryPush(1);
+//   std::optional<int> value = queue.TryPop();
+//
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <utility>
+
+template <class T>
+class MpmcQueue {
+ public:
+  /**
+   * Instantiates an empty queue.
+   *
+   * @param min_capacity Number of elements the queue must be able to hold. The
+   *   actual capacity is this rounded up to a power of two, and at least 2,
+   *   since a single cell holding a value would look free to the next lap.
+   **/
+  explicit MpmcQueue(size_t min_capacity) {
+    size_t capacity = 2;
+    while (capacity < min_capacity) capacity *= 2;
+    mask_ = capacity - 1;
+    cells_ = std::make_unique<Cell[]>(capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Not copyable or movable, since other threads hold on to the cells.
+  MpmcQueue(const MpmcQueue&) = delete;
+  MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+  ~MpmcQueue() {
+    while (TryPop().has_value()) {
+    }
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  /**
+   * Pushes a value if there is room.
+   *
+   * @return False if the queue was full, in which case value is untouched.
+   **/
+  bool TryPush(T&& value) {
+    return TryPushWith([&value]() -> T&& { return std::move(value); });
+  }
+
+  /**
+   * Like TryPush(), but constructs the value from make_value() only after a
+   * slot has been claimed. The values are popped in the order in which
+   * make_value() was called, unless two calls happen concurrently.
+   *
+   * @return False if the queue was full, in which case make_value was not
+   *   called.
+   **/
+  template <class MakeValueFn>
+  bool TryPushWith(MakeValueFn&& make_value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      if (sequence == pos) {
+        // The cell is free. Try to claim it.
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (sequence < pos) {
+        // The cell still holds the value from one lap ago.
+        return false;
+      } else {
+        // Another producer claimed this position.
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (cell->storage) T(make_value());
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Pops the oldest value.
+   *
+   * @return Empty if the queue was empty.
+   **/
+  std::optional<T> TryPop() {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      if (sequence == pos + 1) {
+        // The cell has been published. Try to claim it.
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (sequence < pos + 1) {
+        // Nothing has been published here yet.
+        return {};
+      } else {
+        // Another consumer claimed this position.
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    T* value = std::launder(reinterpret_cast<T*>(cell->storage));
+    std::optional<T> result{std::move(*value)};
+    value->~T();
+    // Hand the cell to the producer of the next lap.
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return result;
+  }
+
+  // True if the next TryPop() would fail, barring concurrent changes.
+  bool Empty() const {
+    size_t pos = dequeue_pos_.load(std::memory_order_acquire);
+    return cells_[pos & mask_].sequence.load(std::memory_order_acquire) <
+           pos + 1;
+  }
+
+  // True if the next TryPush() would fail, barring concurrent changes.
+  bool Full() const {
+    size_t pos = enqueue_pos_.load(std::memory_order_acquire);
+    return cells_[pos & mask_].sequence.load(std::memory_order_acquire) < pos;
+  }
+
+  // Approximate number of values in the queue.
+  size_t Size() const {
+    size_t dequeue_pos = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t enqueue_pos = enqueue_pos_.load(std::memory_order_relaxed);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+  }
+
+ private:
+  // Avoids false sharing between the position counters and the cells.
+  static constexpr size_t kCacheLineSize = 64;
+
+  struct Cell {
+    // Equals the position of the next push into this cell while it is empty,
+    // and one more than that once the value is published.
+    std::atomic<size_t> sequence;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(kCacheLineSize) std::atomic<size_t> enqueue_pos_{0};
+  alignas(kCacheLineSize) std::atomic<size_t> dequeue_pos_{0};
+};
+
+#endif  // MPMC_QUEUE_H
@@ -0,0 +1,110 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mpmc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+TEST(MpmcQueueTest, FifoAndBounded) {
+  MpmcQueue<int> queue{3};
+  ASSERT_EQ(queue.capacity(), 4);
+  ASSERT_TRUE(queue.Empty());
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue.TryPush(int{i}));
+  }
+  ASSERT_TRUE(queue.Full());
+  ASSERT_FALSE(queue.TryPush(4));
+  ASSERT_EQ(queue.Size(), 4);
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_EQ(queue.TryPop(), i);
+  }
+  ASSERT_FALSE(queue.TryPop().has_value());
+}
+
+// A queue asked to hold a single value still refuses a second one.
+TEST(MpmcQueueTest, MinimalCapacity) {
+  MpmcQueue<int> queue{1};
+  ASSERT_EQ(queue.capacity(), 2);
+  ASSERT_TRUE(queue.TryPush(0));
+  ASSERT_TRUE(queue.TryPush(1));
+  ASSERT_TRUE(queue.Full());
+  ASSERT_FALSE(queue.TryPush(2));
+  ASSERT_EQ(queue.TryPop(), 0);
+  ASSERT_EQ(queue.TryPop(), 1);
+  ASSERT_TRUE(queue.Empty());
+}
+
+// Values which were not popped must be destroyed with the queue.
+TEST(MpmcQueueTest, MoveOnlyValues) {
+  auto value = std::make_shared<int>(5);
+  {
+    MpmcQueue<std::unique_ptr<std::shared_ptr<int>>> queue{4};
+    ASSERT_TRUE(
+        queue.TryPush(std::make_unique<std::shared_ptr<int>>(value)));
+    ASSERT_TRUE(
+        queue.TryPush(std::make_unique<std::shared_ptr<int>>(value)));
+    ASSERT_EQ(**queue.TryPop(), value);
+    ASSERT_EQ(value.use_count(), 2);
+  }
+  ASSERT_EQ(value.use_count(), 1);
+}
+
+// Every value pushed by any thread is popped exactly once.
+TEST(MpmcQueueTest, MultipleProducersAndConsumers) {
+  constexpr int kPerProducer = 10000;
+  constexpr int kNumProducers = 4;
+  MpmcQueue<int> queue{16};
+  std::vector<int> visit_count(kPerProducer * kNumProducers, 0);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kNumProducers; ++p) {
+    threads.emplace_back([&queue, p] {
+      for (int i = p * kPerProducer; i < (p + 1) * kPerProducer; ++i) {
+        while (!queue.TryPush(int{i})) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  std::vector<std::vector<int>> popped(kNumProducers);
+  for (int c = 0; c < kNumProducers; ++c) {
+    threads.emplace_back([&queue, &popped, c] {
+      for (int i = 0; i < kPerProducer; ++i) {
+        std::optional<int> value;
+        while (!(value = queue.TryPop()).has_value()) {
+          std::this_thread::yield();
+        }
+        popped[c].push_back(*value);
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  for (const std::vector<int>& values : popped) {
+    for (int value : values) {
+      ++visit_count[value];
+    }
+  }
+  ASSERT_EQ(visit_count, std::vector<int>(kPerProducer * kNumProducers, 1));
+  ASSERT_TRUE(queue.Empty());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -36,22 +36,229 @@
 // - If workers are full, this blocks untill next one is free.
 // - On destruction blocks untill all pending work is finished.
 //
+// Finer control is available by passing OrderedThreadPoolOptions -
+//
+//   pool = OrderedThreadPool<int>{10, {.reorder_buffer = true}};
+//
 #ifndef ORDERED_THREAD_POOL_H
 #define ORDERED_THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <iterator>
+#include <memory>
 #include <optional>
-#include <queue>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "job_queue.h"
+#include "latency_histogram.h"
+#include "move_only_function.h"
+#include "pool_future.h"
+#include "pool_trace.h"
+#include "queue_limit_controller.h"
+#include "sharded_counters.h"
+#include "wait_policy.h"
+
+// How OrderedThreadPool::Shutdown() treats the jobs which have not started.
+enum class ShutdownMode {
+  // Runs and delivers all of them. This is what the destructor does.
+  kDrain,
+  // Does not run them, but still calls their completions in order, with a
+  // cancelled result.
+  kCancelPending,
+  // Drops them without calling their completions. Jobs already running
+  // finish, but nothing is delivered after the completion in progress. The
+  // futures of dropped DoAsync() jobs are abandoned, and coroutines awaiting
+  // Schedule() or Ordered() for dropped jobs are never resumed, so their
+  // frames leak unless destroyed by their owner.
+  kAbort,
+};
+
+// Lets long jobs poll whether they should give up early, e.g. since the pool
+// is shutting down without delivering their results. Copies share the state.
+class CancellationToken {
+ public:
+  CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>()) {}
+
+  bool cancelled() const {
+    return cancelled_->load(std::memory_order_relaxed);
+  }
+
+  void Cancel() const { cancelled_->store(true, std::memory_order_relaxed); }
+
+ private:
+  std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Optional settings for OrderedThreadPool. The defaults match the behavior of
+// OrderedThreadPool(num_workers).
+struct OrderedThreadPoolOptions {
+  // If the workers are all occupied, and this many jobs are in the queue,
+  // calling thread will be blocked till a worker is free. A value of 0 removes
+  // the limit. Jobs submitted from a job or completion of the pool itself are
+  // never blocked, since the worker would wait for itself, and may exceed the
+  // limit.
+  int max_pending_jobs = 1;
+  // If set, max_pending_jobs is only the initial limit, which the workers then
+  // adjust between min_pending_jobs and max_adaptive_pending_jobs with an AIMD
+  // rule: halved while jobs wait in the queue longer than target_queue_wait on
+  // average, and raised by one while workers are idle. See
+  // QueueLimitController. The current limit is returned by
+  // OrderedThreadPool::max_pending_jobs().
+  bool adaptive_pending_jobs = false;
+  int min_pending_jobs = 1;
+  int max_adaptive_pending_jobs = 1024;
+  std::chrono::microseconds target_queue_wait = std::chrono::milliseconds(1);
+  // Limits the total cost of the jobs passed to Do() with a cost, from
+  // submission till their completion_fn has returned. This covers the jobs
+  // which are queued, running, and finished but waiting for their turn, since
+  // that is where large results pile up. Do() blocks while the limit would be
+  // exceeded, unless nothing else is outstanding, so that a job costlier than
+  // the limit still runs on its own. A value of 0 removes the limit.
+  int64_t max_pending_cost = 0;
+  // Limits the jobs submitted and not yet delivered, i.e. queued, running or
+  // finished but waiting for their turn. Unlike max_pending_jobs, this bounds
+  // the results held back when the oldest job is slow. Do() blocks while this
+  // many jobs are outstanding. Jobs submitted with a key are limited per
+  // bucket. As with max_pending_jobs, jobs submitted from a job or completion
+  // of the pool itself are never blocked, and may exceed the limit. A value
+  // of 0 removes the limit.
+  int max_in_flight = 0;
+  // By default a worker which finishes a job before its predecessors waits for
+  // its turn to call completion_fn. With this set, the result is parked in a
+  // reorder buffer instead and the worker moves on to the next job. The thread
+  // which completes the oldest outstanding job delivers all consecutive parked
+  // results.
+  //
+  // This keeps all workers busy when job durations are skewed, at the cost of
+  // holding the parked results in memory.
+  bool reorder_buffer = false;
+  // Replaces the mutex guarding the job queue with a bounded lock-free ring of
+  // max_pending_jobs rounded up to a power of two, or
+  // JobQueue::kDefaultLockFreeCapacity if max_pending_jobs is 0. Threads only
+  // park when the ring is empty or full. This helps when jobs are so short that
+  // the queue mutex becomes contended.
+  //
+  // Implies reorder_buffer, since jobs may leave the ring slightly out of order
+  // when several threads call Do() at once.
+  bool lock_free_queue = false;
+  // Gives each worker its own Chase-Lev deque, so that workers mostly touch
+  // their own memory rather than the one shared queue. Do() from outside the
+  // pool feeds a shared injection queue, from which an idle worker takes a
+  // batch of jobs at a time into its deque. Do() from inside a job pushes to
+  // the deque of the calling worker. Idle workers steal from the others. This
+  // helps scaling to many cores.
+  //
+  // max_pending_jobs then limits the jobs in all the queues together. Implies
+  // reorder_buffer, since a worker runs the newest job of its own deque first.
+  bool work_stealing = false;
+  // How threads wait for a job, for room in the queue, and for their ticket.
+  // By default they park on a condition variable right away. Spinning first
+  // saves the cost of sleeping and waking up when jobs are very short, at the
+  // cost of burning CPU while there is nothing to do. Only worth it with more
+  // cores than busy threads, otherwise spinning delays the thread it waits for.
+  WaitPolicy wait_policy;
+  // Number of independent orders for jobs submitted with a key. Keys are
+  // hashed into this many buckets, and only the completions of jobs in the
+  // same bucket are ordered with respect to each other. Values below 1 count
+  // as 1.
+  int num_key_buckets = 64;
+  // Most results passed at once to the batch completion, if one is given to
+  // the constructor.
+  int max_completion_batch = 64;
+  // If greater than num_workers, the pool is elastic: a worker is added when a
+  // job is submitted while all workers are busy, up to max_workers, and a
+  // worker which found no job for idle_timeout exits, down to num_workers or
+  // the count last passed to OrderedThreadPool::Resize(). With work_stealing,
+  // a deque is allocated for each of the max_workers.
+  int max_workers = 0;
+  std::chrono::milliseconds idle_timeout = std::chrono::seconds(10);
+  // Counts the jobs started and completed, and measures the time threads
+  // spend blocked and working, for OrderedThreadPool::Stats(). Costs a few
+  // clock reads per job. Counts are kept per thread, so that workers do not
+  // contend on them.
+  bool collect_stats = false;
+  // Records a histogram of the latency of each phase of a job, for
+  // OrderedThreadPool::Latencies(). Costs a few clock reads per job, and
+  // about 32kB per worker.
+  bool collect_latency = false;
+};
+
+// A snapshot of the state of an OrderedThreadPool, as returned by Stats().
+// Values are read one at a time while the pool runs, so they need not be
+// consistent with each other.
+struct OrderedThreadPoolStats {
+  // Jobs passed to Do() and its variants, and those whose completion has
+  // returned.
+  uint64_t jobs_submitted = 0;
+  uint64_t jobs_delivered = 0;
+  // Jobs whose job_fn was called, and has returned. Only counted with
+  // OrderedThreadPoolOptions::collect_stats.
+  uint64_t jobs_started = 0;
+  uint64_t jobs_completed = 0;
+  // Jobs waiting in the queue for a worker.
+  size_t queue_depth = 0;
+  // Jobs submitted and not yet delivered, i.e. queued, running, or finished
+  // and waiting for their turn.
+  size_t in_flight = 0;
+  // The current limit on pending jobs, see max_pending_jobs().
+  int max_pending_jobs = 0;
+  int num_workers = 0;
+  // Only measured with OrderedThreadPoolOptions::collect_stats -
+  // Total time producers spent in Do() and its variants, mostly blocked on a
+  // full queue or on the limits of in-flight jobs and cost.
+  std::chrono::nanoseconds producer_blocked_time{0};
+  // Total time workers waited for the turn of their result. Stays 0 with a
+  // reorder buffer, and for jobs submitted with a key.
+  std::chrono::nanoseconds ticket_wait_time{0};
+  // Total time workers spent on jobs, i.e. in job_fn, in ticket_wait_time and
+  // in the completions.
+  std::chrono::nanoseconds worker_busy_time{0};
+  // Total time workers waited for a job. A worker's wait is counted when it
+  // takes its next job.
+  std::chrono::nanoseconds worker_idle_time{0};
+};
+
+// Latencies of the phases of the jobs of an OrderedThreadPool, as returned by
+// Latencies(). Their sum is the time from submission to delivery.
+struct OrderedThreadPoolLatencies {
+  // Time from submission till a worker took the job.
+  LatencyHistogram queue;
+  // Time in job_fn.
+  LatencyHistogram run;
+  // Time from the return of job_fn till the completion started, i.e. waiting
+  // for the earlier jobs to be delivered.
+  LatencyHistogram reorder;
+  // Time in completion_fn, or in the batch completion, counted once per call.
+  LatencyHistogram completion;
+
+  void Merge(const OrderedThreadPoolLatencies& other) {
+    queue.Merge(other.queue);
+    run.Merge(other.run);
+    reorder.Merge(other.reorder);
+    completion.Merge(other.completion);
+  }
+};
+
 template <class ReturnType>
 class OrderedThreadPool {
-  using JobFnT = std::function<ReturnType()>;
-  using CompletionFnT = std::function<void(ReturnType)>;
+  // Move-only, so that jobs may capture e.g. std::unique_ptr. Small captures
+  // are stored inline, and jobs are moved rather than copied throughout.
+  using JobFnT = MoveOnlyFunction<ReturnType()>;
+  using CompletionFnT = MoveOnlyFunction<void(ReturnType)>;
+  using BatchCompletionFnT = MoveOnlyFunction<void(std::vector<ReturnType>&)>;
 
  public:
+  // A job and its completion, as passed to Do().
+  using BatchJob = std::pair<JobFnT, CompletionFnT>;
+
   /**
    * Instantiates an ordered queue.
    *
@@ -61,10 +268,89 @@ class OrderedThreadPool {
    *   are in the queue, calling thread will be blocked till a worker is free.
    **/
   OrderedThreadPool(int num_workers, int max_pending_jobs = 1)
-      : max_queue_size_(max_pending_jobs) {
-    for (int i = 0; i < num_workers; ++i) {
-      workers_.push_back(std::thread(&OrderedThreadPool::Worker, this));
+      : OrderedThreadPool(num_workers, OrderedThreadPoolOptions{
+                                           .max_pending_jobs = max_pending_jobs,
+                                       }) {}
+
+  /**
+   * Instantiates an ordered queue with non-default options.
+   *
+   * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+   *   threads, and use the calling thread to perform the work.
+   * @param options See OrderedThreadPoolOptions.
+   **/
+  OrderedThreadPool(int num_workers, const OrderedThreadPoolOptions& options)
+      : OrderedThreadPool(num_workers, options, nullptr) {}
+
+  /**
+   * Instantiates an ordered queue which delivers results in batches.
+   *
+   * Jobs submitted with a null on_completion have their results passed to
+   * batch_completion instead. It is called with up to
+   * OrderedThreadPoolOptions::max_completion_batch consecutive results at once,
+   * in order, whenever several have finished by the time the oldest one is
+   * delivered. This allows e.g. one write for several results. It may move
+   * from the results, and is only called concurrently for different key
+   * buckets.
+   *
+   * Implies reorder_buffer, since results are only batched when parked.
+   *
+   * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+   *   threads, and use the calling thread to perform the work.
+   * @param options See OrderedThreadPoolOptions.
+   * @param batch_completion Called with consecutive results.
+   **/
+  OrderedThreadPool(int num_workers, const OrderedThreadPoolOptions& options,
+                    BatchCompletionFnT batch_completion)
+      // With an adaptive limit, the lock-free ring is made large enough for
+      // the highest limit.
+      : fn_queue_(options.adaptive_pending_jobs
+                      ? options.max_adaptive_pending_jobs
+                      : options.max_pending_jobs,
+                  options.lock_free_queue,
+                  options.work_stealing
+                      ? std::max(num_workers, options.max_workers)
+                      : 0,
+                  options.wait_policy),
+        threaded_(num_workers > 0),
+        min_workers_(num_workers),
+        max_workers_(num_workers > 0 && options.max_workers > num_workers
+                         ? options.max_workers
+                         : 0),
+        idle_timeout_(options.idle_timeout),
+        wait_policy_(options.wait_policy),
+        max_pending_jobs_(options.max_pending_jobs),
+        max_pending_cost_(options.max_pending_cost),
+        max_in_flight_(options.max_in_flight),
+        stats_(options.collect_stats
+                   ? std::make_unique<ShardedCounters<kNumStatsCounters>>()
+                   : nullptr),
+        collect_latency_(options.collect_latency),
+        reorder_buffer_(options.reorder_buffer || options.lock_free_queue ||
+                        options.work_stealing || batch_completion),
+        num_key_buckets_(std::max(1, options.num_key_buckets)),
+        batch_completion_(std::move(batch_completion)),
+        max_completion_batch_(options.max_completion_batch) {
+    // Workers waiting for their tickets hold consecutive job_ids, so with at
+    // least as many slots as workers each waits on a slot of its own.
+    size_t num_slots = 1;
+    while (num_slots < (size_t)std::max(num_workers, max_workers_)) {
+      num_slots *= 2;
     }
+    ticket_slots_ = std::make_unique<TicketSlot[]>(num_slots);
+    ticket_slot_mask_ = num_slots - 1;
+    key_lines_ = std::make_unique<TicketLine[]>(num_key_buckets_);
+    if (options.adaptive_pending_jobs && num_workers > 0) {
+      limit_controller_ = std::make_unique<QueueLimitController>(
+          QueueLimitController::Options{
+              .initial = options.max_pending_jobs,
+              .min = options.min_pending_jobs,
+              .max = options.max_adaptive_pending_jobs,
+              .target_queue_wait = options.target_queue_wait});
+      fn_queue_.SetMaxPending(limit_controller_->limit());
+    }
+    std::lock_guard<std::mutex> lck(workers_mtx_);
+    AddWorkersLocked(num_workers);
   }
 
   // Movable but not copyable.
@@ -80,109 +366,1223 @@ class OrderedThreadPool {
    * @param fn A function spec that constitutes bulk of the job. This will be
    *   parallelized.
    * @param on_completion A function which will be called with the result of
-   *   fn().
+   *   fn(). May be null if a batch completion was given to the constructor.
    **/
   void Do(JobFnT fn, CompletionFnT on_completion) {
-    if (workers_.empty()) {
+    if (!threaded_) {
       // Number of threads requested is 0. Run everything on main thread.
-      on_completion(fn());
+      Complete(on_completion, fn());
+      return;
+    }
+    Push(line_, std::move(fn), std::move(on_completion));
+  }
+
+  /**
+   * Like Do(), for a job weighing cost towards
+   * OrderedThreadPoolOptions::max_pending_cost, e.g. the size of its payload
+   * and result in bytes.
+   *
+   * Blocks till the cost is available. This waits for earlier jobs to be
+   * delivered, so it must not be called from a job or completion_fn of this
+   * pool.
+   *
+   * @param cost Non-negative. Jobs submitted without a cost count as 0.
+   **/
+  void Do(JobFnT fn, CompletionFnT on_completion, int64_t cost) {
+    if (!threaded_) {
+      Complete(on_completion, fn());
       return;
     }
-    // Push to the job queue and notify.
-    std::unique_lock<std::mutex> lck(fn_queue_mtx_);
-    job_removed_.wait(lck, [this] {
-      return max_queue_size_ == 0 || (int)fn_queue_.size() < max_queue_size_;
+    Push(line_, std::move(fn), std::move(on_completion), cost);
+  }
+
+  /**
+   * Like Do(), but returns false right away instead of blocking if the queue
+   * is full.
+   *
+   * @param fn As in Do(). Only moved from if the job is accepted, so that the
+   *   caller may keep it for a later attempt.
+   * @param on_completion As in Do(). Only moved from if the job is accepted.
+   * @return True if the job was accepted.
+   **/
+  bool TryDo(JobFnT&& fn, CompletionFnT&& on_completion) {
+    return DoUntil(JobQueue<Job>::Clock::time_point::min(), std::move(fn),
+                   std::move(on_completion));
+  }
+
+  /**
+   * Like TryDo(), but waits up to timeout for room in the queue.
+   **/
+  template <class Rep, class Period>
+  bool DoFor(const std::chrono::duration<Rep, Period>& timeout, JobFnT&& fn,
+             CompletionFnT&& on_completion) {
+    return DoUntil(JobQueue<Job>::Clock::now() + timeout, std::move(fn),
+                   std::move(on_completion));
+  }
+
+  /**
+   * Like TryDo(), but waits till deadline for room in the queue.
+   **/
+  template <class Clock, class Duration>
+  bool DoUntil(const std::chrono::time_point<Clock, Duration>& deadline,
+               JobFnT&& fn, CompletionFnT&& on_completion) {
+    if (!threaded_) {
+      Complete(on_completion, fn());
+      return true;
+    }
+    StatsTimer timer{this, kProducerBlockedNs};
+    MaybeGrow();
+    auto queue_deadline = JobQueue<Job>::ToClock(deadline);
+    if (Admit(line_, 1, queue_deadline) == 0) {
+      return false;
+    }
+    bool pushed = fn_queue_.PushUntil(queue_deadline, [&] {
+      return Job{.job_fn = std::move(fn),
+                 .completion_fn = std::move(on_completion),
+                 .line = &line_,
+                 .job_id = line_.NextJobId(),
+                 .queued_at = QueuedAt()};
     });
-    fn_queue_.push(Job{
-        .job_fn = fn, .completion_fn = on_completion, .job_id = job_count_++});
-    job_added_.notify_one();
+    if (!pushed) {
+      Unadmit(line_, 1);
+    }
+    return pushed;
   }
 
-  virtual ~OrderedThreadPool() {
-    terminate_now_ = true;
-    {
-      // Notify holding the lock.
-      // This prevents missing a notification if this executes inbetween when
-      // the wait() checks the predicate to be false and relocks.
-      std::lock_guard<std::mutex> lck(fn_queue_mtx_);
-      job_added_.notify_all();
+  /**
+   * Starts processing of a new job, ordered only with respect to jobs with
+   * the same key.
+   *
+   * Keys are hashed into OrderedThreadPoolOptions::num_key_buckets buckets.
+   * The on_completion of a job is called after those of the earlier jobs in
+   * its bucket, but possibly concurrently with those of other buckets, and in
+   * any order with respect to jobs submitted without a key. Workers never
+   * wait for the turn of a keyed job, as if reorder_buffer was set.
+   *
+   * @param key Anything std::hash accepts, e.g. a user ID or a partition.
+   * @param fn A function spec that constitutes bulk of the job. This will be
+   *   parallelized.
+   * @param on_completion A function which will be called with the result of
+   *   fn().
+   **/
+  template <class Key>
+  void Do(const Key& key, JobFnT fn, CompletionFnT on_completion) {
+    if (!threaded_) {
+      Complete(on_completion, fn());
+      return;
+    }
+    Push(key_lines_[std::hash<Key>()(key) % num_key_buckets_], std::move(fn),
+         std::move(on_completion));
+  }
+
+  /**
+   * Starts processing of a new job, and returns a future for its result
+   * instead of taking a completion function.
+   *
+   * The futures become ready in the order of the calls, as completion_fn
+   * would be called. Continuations added with PoolFuture::Then() run in that
+   * order too, on the worker which delivers the result, without holding any
+   * lock of the pool. They hold up the later results, so they should be as
+   * quick as a completion_fn. Dependent requests may be submitted from them,
+   * and do not block on a full queue.
+   *
+   * If the job is dropped by Shutdown(ShutdownMode::kAbort), the future
+   * becomes ready and Abandoned(), and its Get() throws.
+   *
+   * @param fn A function spec that constitutes bulk of the job. This will be
+   *   parallelized.
+   **/
+  PoolFuture<ReturnType> DoAsync(JobFnT fn) {
+    PoolPromise<ReturnType> promise;
+    PoolFuture<ReturnType> future = promise.GetFuture();
+    Do(std::move(fn), [promise = std::move(promise)](ReturnType result) mutable {
+      promise.Set(std::move(result));
+    });
+    return future;
+  }
+
+  /**
+   * Starts processing of several jobs.
+   *
+   * Equivalent to calling Do() for each of the jobs in order, but the queue is
+   * locked and the workers are woken up once for as many jobs as the queue has
+   * room for.
+   *
+   * @param jobs Pairs of fn and on_completion, as passed to Do().
+   **/
+  void DoBatch(std::vector<BatchJob> jobs) {
+    if (!threaded_) {
+      for (BatchJob& job : jobs) {
+        Complete(job.second, job.first());
+      }
+      return;
+    }
+    StatsTimer timer{this, kProducerBlockedNs};
+    MaybeGrow();
+    for (size_t begin = 0; begin < jobs.size();) {
+      size_t count = Admit(line_, jobs.size() - begin);
+      if (aborted_) return;
+      fn_queue_.PushBatch(count, [&](size_t i) {
+        return Job{.job_fn = std::move(jobs[begin + i].first),
+                   .completion_fn = std::move(jobs[begin + i].second),
+                   .line = &line_,
+                   .job_id = line_.NextJobId(),
+                   .queued_at = QueuedAt()};
+      });
+      begin += count;
+    }
+  }
+
+  /**
+   * Starts processing of one job per element in [first, last), submitted like
+   * DoBatch().
+   *
+   * The work is logically similar to -
+   *
+   *   for (auto it = first; it != last; ++it) on_completion(fn(*it));
+   *
+   * Each element is copied into its job, or moved with std::move_iterator, so
+   * the range need not outlive the call.
+   *
+   * @param fn Called with each element, in parallel. Shared by all the jobs.
+   * @param on_completion Called with each result of fn(), in the order of the
+   *   elements.
+   **/
+  template <class ForwardIt, class Fn, class OnCompletionFn>
+  void DoRange(ForwardIt first, ForwardIt last, Fn fn,
+               OnCompletionFn on_completion) {
+    if (!threaded_) {
+      for (; first != last; ++first) {
+        on_completion(fn(*first));
+      }
+      return;
+    }
+    using Item = typename std::iterator_traits<ForwardIt>::value_type;
+    // Jobs only hold a pointer to the callables, so that they fit inline.
+    auto fns = std::make_shared<std::pair<Fn, OnCompletionFn>>(
+        std::move(fn), std::move(on_completion));
+    auto make_job = [&](size_t) {
+      Item item = *first;
+      ++first;
+      return Job{
+          .job_fn = [fns, item = std::move(item)]() mutable -> ReturnType {
+            return fns->first(std::move(item));
+          },
+          .completion_fn = [fns](ReturnType result) {
+            fns->second(std::move(result));
+          },
+          .line = &line_,
+          .job_id = line_.NextJobId(),
+          .queued_at = QueuedAt()};
+    };
+    StatsTimer timer{this, kProducerBlockedNs};
+    MaybeGrow();
+    for (size_t left = std::distance(first, last); left > 0;) {
+      size_t count = Admit(line_, left);
+      if (aborted_) return;
+      fn_queue_.PushBatch(count, make_job);
+      left -= count;
+    }
+  }
+
+  /**
+   * Returns an awaitable for C++20 coroutines, which resumes the awaiting
+   * coroutine on one of the workers -
+   *
+   *   co_await pool.Schedule();
+   *
+   * The coroutine runs as the job_fn of a job whose result is ignored, so
+   * ReturnType must be default-constructible.
+   **/
+  auto Schedule() { return ScheduleAwaiter{this}; }
+
+  /**
+   * Returns an awaitable for C++20 coroutines, which runs fn on a worker and
+   * resumes the awaiting coroutine with its result in the order of
+   * submission, where completion_fn would be called -
+   *
+   *   ReturnType result = co_await pool.Ordered(CostlyFn);
+   *
+   * Coroutines awaiting Ordered() are thus resumed one at a time, till they
+   * next suspend or finish, like a completion_fn.
+   **/
+  auto Ordered(JobFnT fn) { return OrderedAwaiter{this, std::move(fn)}; }
+
+  // Number of worker threads. 0 if jobs run on the calling thread. Excludes
+  // retiring workers which are still finishing their job.
+  int num_workers() const { return num_workers_.load(); }
+
+  /**
+   * Blocks till all jobs submitted so far have been delivered, i.e. their
+   * completions have returned, or the pool was aborted. The workers stay, so
+   * the pool can be reused, e.g. between phases of a batch job.
+   *
+   * Must not be called from a job or completion of this pool.
+   **/
+  void WaitIdle() {
+    WaitDelivered([this] { return Idle() || aborted_; }, std::nullopt);
+  }
+
+  /**
+   * Like WaitIdle(), but gives up after timeout.
+   *
+   * @return True if all jobs were delivered.
+   **/
+  template <class Rep, class Period>
+  bool WaitIdleFor(const std::chrono::duration<Rep, Period>& timeout) {
+    return WaitDelivered([this] { return Idle() || aborted_; },
+                         JobQueue<Job>::Clock::now() + timeout) &&
+           Idle();
+  }
+
+  /**
+   * Adds or retires workers, so that num_workers become available.
+   *
+   * A retiring worker first finishes its current job, including the delivery
+   * of its result in turn. Jobs are not reassigned, so their order is kept.
+   * Retiring blocks while the queue is full. With work_stealing, adding
+   * blocks till enough retiring workers have exited to free their deques.
+   * With an elastic pool, this also becomes the least number of workers kept
+   * when idle.
+   *
+   * Must not be called from a job or completion of this pool, or on a pool
+   * constructed with 0 workers.
+   *
+   * @param num_workers Positive. With work_stealing, at most the number of
+   *   workers at construction or OrderedThreadPoolOptions::max_workers,
+   *   whichever is more.
+   **/
+  void Resize(int num_workers) {
+    if (!threaded_) {
+      return;
+    }
+    std::unique_lock<std::mutex> lck(workers_mtx_);
+    if (fn_queue_.num_deques() > 0) {
+      num_workers = std::min(num_workers, fn_queue_.num_deques());
+    }
+    num_workers = std::max(num_workers, 1);
+    // Set first, so that idle workers stop retiring below the new count.
+    min_workers_.store(num_workers);
+    if (fn_queue_.num_deques() > 0 && num_workers > num_workers_) {
+      // A retiring worker keeps its deque till it exits.
+      worker_exited_.wait(lck, [this, num_workers] {
+        return NumRetiringLocked() + num_workers <= fn_queue_.num_deques();
+      });
+    }
+    int current = num_workers_.load();
+    if (num_workers > current) {
+      AddWorkersLocked(num_workers - current);
+      return;
+    }
+    int num_retiring = current - num_workers;
+    num_workers_ -= num_retiring;
+    // A job without job_fn tells the worker which takes it to exit.
+    for (int i = 0; i < num_retiring; ++i) {
+      fn_queue_.Push([] { return Job{}; });
+    }
+  }
+
+  // The current limit on pending jobs. Only changes with
+  // OrderedThreadPoolOptions::adaptive_pending_jobs.
+  int max_pending_jobs() const {
+    return limit_controller_ ? limit_controller_->limit() : max_pending_jobs_;
+  }
+
+  /**
+   * Returns counters and measurements of the pool, e.g. to export as metrics.
+   * Cheap enough to call periodically while the pool runs.
+   *
+   * See OrderedThreadPoolStats, and OrderedThreadPoolOptions::collect_stats
+   * for the values which are only collected on request.
+   **/
+  OrderedThreadPoolStats Stats() const {
+    OrderedThreadPoolStats stats;
+    // The ticket is loaded first, so that it does not pass the job count.
+    auto add_line = [&stats](const TicketLine& line) {
+      size_t delivered = line.ticket_num.load();
+      stats.jobs_delivered += delivered;
+      stats.jobs_submitted += line.job_count.load();
+      stats.in_flight += line.job_count.load() - delivered;
+    };
+    add_line(line_);
+    for (int i = 0; i < num_key_buckets_; ++i) {
+      add_line(key_lines_[i]);
     }
-    for (std::thread& t : workers_) {
-      t.join();
+    stats.queue_depth = fn_queue_.Size();
+    stats.max_pending_jobs = max_pending_jobs();
+    stats.num_workers = num_workers();
+    if (stats_) {
+      stats.jobs_started = stats_->Sum(kStarted);
+      stats.jobs_completed = stats_->Sum(kCompleted);
+      stats.producer_blocked_time =
+          std::chrono::nanoseconds(stats_->Sum(kProducerBlockedNs));
+      stats.ticket_wait_time =
+          std::chrono::nanoseconds(stats_->Sum(kTicketWaitNs));
+      stats.worker_busy_time = std::chrono::nanoseconds(stats_->Sum(kBusyNs));
+      stats.worker_idle_time = std::chrono::nanoseconds(stats_->Sum(kIdleNs));
     }
+    return stats;
   }
 
+  /**
+   * Returns histograms of the latency of each phase of the jobs so far, if
+   * OrderedThreadPoolOptions::collect_latency is set. Each worker records its
+   * own, and these are merged here, so this is slower than Stats(). Includes
+   * the workers which have exited.
+   **/
+  OrderedThreadPoolLatencies Latencies() const {
+    OrderedThreadPoolLatencies latencies;
+    std::lock_guard<std::mutex> lck(workers_mtx_);
+    if (retired_latency_) {
+      latencies.Merge(*retired_latency_);
+    }
+    for (const std::unique_ptr<WorkerThread>& worker : workers_) {
+      if (worker->latency) {
+        latencies.Merge(*worker->latency);
+      }
+    }
+    return latencies;
+  }
+
+  /**
+   * Stops the pool, and blocks till the workers have exited. Jobs must not be
+   * submitted afterwards. Returns right away if called again.
+   *
+   * @param mode What happens to the jobs which have not started. Unless it is
+   *   kDrain, cancellation_token() is cancelled too.
+   * @param cancelled_result With kCancelPending, provides the result passed
+   *   to the completions of jobs which are not run, e.g. an error status. If
+   *   null, ReturnType() is passed, or the jobs are run after all if ReturnType
+   *   is not default constructible.
+   **/
+  void Shutdown(ShutdownMode mode = ShutdownMode::kDrain,
+                JobFnT cancelled_result = nullptr) {
+    if (mode == ShutdownMode::kCancelPending) {
+      cancelled_result_ = std::move(cancelled_result);
+      cancel_pending_.store(true, std::memory_order_release);
+      cancellation_token_.Cancel();
+    } else if (mode == ShutdownMode::kAbort) {
+      aborted_.store(true);
+      cancellation_token_.Cancel();
+      {
+        // Wake up the workers waiting for a ticket which will not come.
+        std::lock_guard<std::mutex> lck(line_.mtx);
+        for (size_t i = 0; i <= ticket_slot_mask_; ++i) {
+          ticket_slots_[i].turn.notify_all();
+        }
+      }
+      // Wake up the producers and WaitIdle(), which would wait for deliveries
+      // that will not come either.
+      {
+        std::lock_guard<std::mutex> lck(delivery_mtx_);
+        delivered_.notify_all();
+      }
+      std::lock_guard<std::mutex> lck(cost_mtx_);
+      cost_released_.notify_all();
+    }
+    // Workers take the entire queue, running jobs as per the mode, and exit.
+    fn_queue_.Close();
+    // Join without the lock, since jobs may still add workers meanwhile.
+    while (true) {
+      std::vector<std::unique_ptr<WorkerThread>> workers;
+      {
+        std::lock_guard<std::mutex> lck(workers_mtx_);
+        workers.swap(workers_);
+      }
+      if (workers.empty()) break;
+      for (std::unique_ptr<WorkerThread>& worker : workers) {
+        worker->thread.join();
+      }
+      std::lock_guard<std::mutex> lck(workers_mtx_);
+      for (std::unique_ptr<WorkerThread>& worker : workers) {
+        RetireLatencyLocked(*worker);
+      }
+    }
+    if (aborted_) {
+      // Drop the parked results, abandoning their futures now rather than
+      // when the pool is destroyed.
+      ClearParked(line_);
+      for (int i = 0; i < num_key_buckets_; ++i) {
+        ClearParked(key_lines_[i]);
+      }
+    }
+  }
+
+  // Cancelled by Shutdown() unless it drains the jobs. Jobs may poll it to
+  // return early.
+  const CancellationToken& cancellation_token() const {
+    return cancellation_token_;
+  }
+
+  virtual ~OrderedThreadPool() { Shutdown(); }
+
  private:
+  struct TicketLine;
+
   struct Job {
     // A function which will be parallelized.
     JobFnT job_fn;
     // A quick function. Output of job_fn will be passed to this method. All
-    // calls to this will happen in same order as enqueuing, and under a lock.
+    // calls to this will happen in same order as enqueuing, and never
+    // concurrently.
     CompletionFnT completion_fn;
-    // Internal ticket number. Used in waiting for previous jobs.
+    // The order this job is delivered in.
+    TicketLine* line;
+    // Internal ticket number within line. Used in waiting for previous jobs.
     size_t job_id;
+    // Counted towards max_pending_cost_ till completion_fn has returned.
+    int64_t cost = 0;
+    // When the job was pushed, if the queue limit is adaptive or latency is
+    // collected.
+    std::chrono::steady_clock::time_point queued_at;
   };
 
-  // Blocks till a next job is available, or termination signal is received.
-  // If termination is requested, returns empty.
-  std::optional<Job> NextJob() {
-    std::unique_lock<std::mutex> lck(fn_queue_mtx_);
-    job_added_.wait(lck,
-                    [this] { return !fn_queue_.empty() || terminate_now_; });
-    // If requested to terminate, finish the entire queue and exit.
-    if (terminate_now_ && fn_queue_.empty()) {
-      return {};
-    }
-    Job result = fn_queue_.front();
-    fn_queue_.pop();
-    job_removed_.notify_one();
-    return result;
+  // The awaitables are templated on the coroutine handle, so that this header
+  // does not need <coroutine> and still compiles as C++17.
+  struct ScheduleAwaiter {
+    OrderedThreadPool* pool;
+
+    bool await_ready() const { return !pool->threaded_; }
+    template <class Handle>
+    void await_suspend(Handle handle) {
+      pool->Do(
+          [handle] {
+            handle.resume();
+            return ReturnType();
+          },
+          [](ReturnType) {});
+    }
+    void await_resume() const {}
+  };
+
+  struct OrderedAwaiter {
+    OrderedThreadPool* pool;
+    JobFnT fn;
+    std::optional<ReturnType> result;
+
+    // Without workers, fn runs inline in await_resume().
+    bool await_ready() const { return !pool->threaded_; }
+    template <class Handle>
+    void await_suspend(Handle handle) {
+      pool->Do(std::move(fn), [this, handle](ReturnType value) {
+        result.emplace(std::move(value));
+        handle.resume();
+      });
+    }
+    ReturnType await_resume() {
+      if (!result.has_value()) {
+        return fn();
+      }
+      return std::move(*result);
+    }
+  };
+
+  // A result waiting in the reorder buffer for its turn.
+  struct Finished {
+    ReturnType result;
+    CompletionFnT completion_fn;
+    int64_t cost;
+    // When job_fn returned, if latency is collected.
+    std::chrono::steady_clock::time_point finished_at;
+  };
+
+  // Ticket system to ensure chronological delivery of a sequence of jobs: the
+  // jobs submitted without a key, or those of one key bucket.
+  struct TicketLine {
+    // Incremental job_id passed to each job.
+    std::atomic<size_t> job_count{0};
+    // The next job with job_id matching this will proceed with
+    // completion_fn(). Only changed under mtx, but may be read without it
+    // while spinning.
+    std::atomic<size_t> ticket_num{0};
+    // The mutex to lock for second function.
+    std::mutex mtx;
+    // Results which finished ahead of ticket_num, indexed by job_id modulo the
+    // size. The size is zero till a result is parked, and then always a power
+    // of two. Guarded by mtx.
+    std::vector<std::optional<Finished>> reorder_ring;
+    // Set while a thread is delivering consecutive results from reorder_ring.
+    bool draining = false;
+    // Jobs let into the window of max_in_flight_. Runs ahead of job_count by
+    // the jobs admitted but not yet pushed.
+    std::atomic<size_t> num_admitted{0};
+
+    // Called once per job as it is pushed.
+    size_t NextJobId() {
+      size_t job_id = job_count.fetch_add(1, std::memory_order_relaxed);
+      pool_trace::Record(pool_trace::EventType::kEnqueue, job_id);
+      return job_id;
+    }
+  };
+
+  // Delivers a result on the calling thread, when there are no workers.
+  void Complete(CompletionFnT& on_completion, ReturnType result) {
+    if (on_completion) {
+      on_completion(std::move(result));
+      return;
+    }
+    std::vector<ReturnType> batch;
+    batch.push_back(std::move(result));
+    batch_completion_(batch);
   }
 
-  void Worker() {
+  // Push to the job queue and notify. Unless the queue is lock-free, the
+  // job_id is taken under the queue's lock so that jobs leave the queue in
+  // the order of their tickets.
+  void Push(TicketLine& line, JobFnT fn, CompletionFnT on_completion,
+            int64_t cost = 0) {
+    StatsTimer timer{this, kProducerBlockedNs};
+    AcquireCost(cost);
+    MaybeGrow();
+    Admit(line, 1);
+    if (aborted_) {
+      // Drops the job, as if it had been queued.
+      return;
+    }
+    fn_queue_.Push([&] {
+      return Job{.job_fn = std::move(fn),
+                 .completion_fn = std::move(on_completion),
+                 .line = &line,
+                 .job_id = line.NextJobId(),
+                 .cost = cost,
+                 .queued_at = QueuedAt()};
+    });
+  }
+
+  // Lets up to count jobs into the window of line, waiting till at least one
+  // fits or the deadline has passed. Returns the number admitted, which is 0
+  // only on timeout. Jobs are admitted before they are pushed, since waiting
+  // while holding the queue's lock would keep the workers from the jobs which
+  // open the window. Workers are admitted right away, since the window only
+  // opens once they deliver. Everything is admitted once the pool is aborted.
+  size_t Admit(TicketLine& line, size_t count,
+               std::optional<typename JobQueue<Job>::Clock::time_point>
+                   deadline = {}) {
+    if (max_in_flight_ == 0) {
+      return count;
+    }
+    if (fn_queue_.CalledFromWorker()) {
+      line.num_admitted.fetch_add(count);
+      return count;
+    }
+    size_t admitted = line.num_admitted.load();
+    auto has_room = [this, &line, &admitted] {
+      admitted = line.num_admitted.load();
+      return admitted - line.ticket_num.load() < (size_t)max_in_flight_ ||
+             aborted_;
+    };
     while (true) {
-      std::optional<Job> job_opt = NextJob();
-      if (!job_opt.has_value()) {
-        // This means the workers should terminate.
+      if (aborted_) {
+        return count;
+      }
+      if (has_room()) {
+        size_t room = max_in_flight_ - (admitted - line.ticket_num.load());
+        size_t num = std::min(count, room);
+        if (line.num_admitted.compare_exchange_weak(admitted, admitted + num)) {
+          return num;
+        }
+        continue;
+      }
+      if (!WaitDelivered(has_room, deadline)) {
+        return 0;
+      }
+    }
+  }
+
+  // Whether every job submitted so far has been delivered.
+  bool Idle() const {
+    if (line_.ticket_num.load() != line_.job_count.load()) {
+      return false;
+    }
+    for (int i = 0; i < num_key_buckets_; ++i) {
+      if (key_lines_[i].ticket_num.load() != key_lines_[i].job_count.load()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns admissions of jobs which were not pushed after all.
+  void Unadmit(TicketLine& line, size_t count) {
+    if (max_in_flight_ > 0) {
+      line.num_admitted.fetch_sub(count);
+      NotifyDelivered();
+    }
+  }
+
+  // Spins as per wait_policy_, and then sleeps till ready() holds or the
+  // deadline, if any, has passed. ready() must only depend on the tickets and
+  // job counts of the lines, loaded with the default seq_cst order, or on
+  // aborted_, which Shutdown() notifies under delivery_mtx_. Returns whether
+  // ready() holds.
+  template <class ReadyFn>
+  bool WaitDelivered(
+      ReadyFn ready,
+      std::optional<typename JobQueue<Job>::Clock::time_point> deadline) {
+    if (deadline.has_value() && JobQueue<Job>::Clock::now() >= *deadline) {
+      return ready();
+    }
+    if (SpinUntil(wait_policy_, ready)) {
+      return true;
+    }
+    std::unique_lock<std::mutex> lck(delivery_mtx_);
+    delivery_waiters_.fetch_add(1);
+    bool is_ready = true;
+    if (deadline.has_value()) {
+      is_ready = delivered_.wait_until(lck, *deadline, ready);
+    } else {
+      delivered_.wait(lck, ready);
+    }
+    delivery_waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return is_ready;
+  }
+
+  // Wakes up threads in WaitDelivered() after a ticket was advanced. Cheap when
+  // there are none, since it does not take the lock. Tickets are advanced with
+  // seq_cst operations, so either this sees the waiter, or the waiter sees the
+  // new ticket.
+  void NotifyDelivered() {
+    if (delivery_waiters_.load() > 0) {
+      std::lock_guard<std::mutex> lck(delivery_mtx_);
+      delivered_.notify_all();
+    }
+  }
+
+  // Blocks till cost fits within max_pending_cost_, or the pool is aborted,
+  // and counts it.
+  void AcquireCost(int64_t cost) {
+    if (max_pending_cost_ == 0 || cost <= 0) {
+      return;
+    }
+    std::unique_lock<std::mutex> lck(cost_mtx_);
+    cost_released_.wait(lck, [this, cost] {
+      return pending_cost_ == 0 || pending_cost_ + cost <= max_pending_cost_ ||
+             aborted_;
+    });
+    pending_cost_ += cost;
+  }
+
+  // Called once the jobs weighing cost in total have been delivered.
+  void ReleaseCost(int64_t cost) {
+    if (max_pending_cost_ == 0 || cost <= 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lck(cost_mtx_);
+    pending_cost_ -= cost;
+    cost_released_.notify_all();
+  }
+
+  // The time to record as queued_at of a new job.
+  std::chrono::steady_clock::time_point QueuedAt() const {
+    return limit_controller_ || collect_latency_
+               ? std::chrono::steady_clock::now()
+               : std::chrono::steady_clock::time_point();
+  }
+
+  // The result delivered in place of running job, after
+  // Shutdown(ShutdownMode::kCancelPending).
+  ReturnType Cancelled(Job& job) {
+    if (cancelled_result_) {
+      return cancelled_result_();
+    }
+    if constexpr (std::is_default_constructible_v<ReturnType>) {
+      return ReturnType();
+    } else {
+      return job.job_fn();
+    }
+  }
+
+  // Reports to limit_controller_ and stats_ how long a worker waited for job,
+  // and the job for the worker.
+  void RecordIdle(std::chrono::steady_clock::time_point idle_since,
+                  std::chrono::steady_clock::time_point now, const Job& job) {
+    if (stats_) {
+      AddTime(kIdleNs, now - idle_since);
+    }
+    if (!limit_controller_) {
+      return;
+    }
+    // Retiring and elastic workers change the count of workers reporting.
+    const int num_workers = num_workers_.load(std::memory_order_relaxed);
+    if (std::optional<int> limit = limit_controller_->Record(
+            now, now - idle_since, now - job.queued_at, num_workers)) {
+      fn_queue_.SetMaxPending(*limit);
+    }
+  }
+
+  // Counters of stats_.
+  enum StatsCounter {
+    kStarted,
+    kCompleted,
+    kProducerBlockedNs,
+    kTicketWaitNs,
+    kBusyNs,
+    kIdleNs,
+    kNumStatsCounters,
+  };
+
+  // Adds duration to a time counter of stats_, which must be set.
+  void AddTime(StatsCounter counter, std::chrono::nanoseconds duration) {
+    stats_->Add(counter, duration.count());
+  }
+
+  // Adds its lifetime to a time counter of stats_, if set.
+  class StatsTimer {
+   public:
+    StatsTimer(OrderedThreadPool* pool, StatsCounter counter)
+        : pool_(pool->stats_ ? pool : nullptr), counter_(counter) {
+      if (pool_) start_ = std::chrono::steady_clock::now();
+    }
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+    ~StatsTimer() {
+      if (pool_) {
+        pool_->AddTime(counter_, std::chrono::steady_clock::now() - start_);
+      }
+    }
+
+   private:
+    OrderedThreadPool* const pool_;
+    const StatsCounter counter_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  // A worker thread. Exited workers are joined and removed by the next call
+  // to AddWorkersLocked(), or on destruction.
+  struct WorkerThread {
+    std::thread thread;
+    // Index passed to fn_queue_.Pop(). Distinct among the workers which have
+    // not exited.
+    int index;
+    std::atomic<bool> exited{false};
+    // Recorded by the worker, if latency is collected.
+    std::unique_ptr<OrderedThreadPoolLatencies> latency;
+  };
+
+  // Keeps the latencies recorded by a worker which has exited. Must hold
+  // workers_mtx_.
+  void RetireLatencyLocked(const WorkerThread& worker) {
+    if (!worker.latency) {
+      return;
+    }
+    if (!retired_latency_) {
+      retired_latency_ = std::make_unique<OrderedThreadPoolLatencies>();
+    }
+    retired_latency_->Merge(*worker.latency);
+  }
+
+  // Spawns count workers. Must hold workers_mtx_.
+  void AddWorkersLocked(int count) {
+    auto reap = [this](std::unique_ptr<WorkerThread>& worker) {
+      if (!worker->exited) return false;
+      worker->thread.join();
+      RetireLatencyLocked(*worker);
+      return true;
+    };
+    workers_.erase(std::remove_if(workers_.begin(), workers_.end(), reap),
+                   workers_.end());
+    std::vector<bool> used;
+    for (const std::unique_ptr<WorkerThread>& worker : workers_) {
+      if ((size_t)worker->index >= used.size()) used.resize(worker->index + 1);
+      used[worker->index] = true;
+    }
+    int index = 0;
+    for (int i = 0; i < count; ++i) {
+      while ((size_t)index < used.size() && used[index]) ++index;
+      if (fn_queue_.num_deques() > 0 && index >= fn_queue_.num_deques()) {
+        // Each worker needs a deque of its own.
         return;
       }
-      Job job = job_opt.value();
+      auto worker = std::make_unique<WorkerThread>();
+      worker->index = index++;
+      if (collect_latency_) {
+        worker->latency = std::make_unique<OrderedThreadPoolLatencies>();
+      }
+      worker->thread = std::thread(&OrderedThreadPool::Worker, this,
+                                   worker.get());
+      workers_.push_back(std::move(worker));
+      ++num_workers_;
+    }
+  }
 
-      // This runs parallelly across all threads.
-      ReturnType result = job.job_fn();
+  // Workers which no longer count towards num_workers_, but have not exited
+  // yet. Must hold workers_mtx_.
+  int NumRetiringLocked() const {
+    int num_running = 0;
+    for (const std::unique_ptr<WorkerThread>& worker : workers_) {
+      if (!worker->exited) ++num_running;
+    }
+    return num_running - num_workers_.load();
+  }
+
+  // Called before a job is submitted. Adds a worker to an elastic pool if all
+  // are busy.
+  void MaybeGrow() {
+    if (max_workers_ == 0 ||
+        busy_workers_.load(std::memory_order_relaxed) < num_workers_ ||
+        num_workers_ >= max_workers_) {
+      return;
+    }
+    std::lock_guard<std::mutex> lck(workers_mtx_);
+    if (busy_workers_ >= num_workers_ && num_workers_ < max_workers_) {
+      AddWorkersLocked(1);
+    }
+  }
 
-      // Wait till our turn comes.
-      std::unique_lock<std::mutex> lck(ticket_mtx_);
-      ticket_update_.wait(lck,
-                          [this, &job] { return ticket_num_ == job.job_id; });
-      // Perform the second part of the task.
-      job.completion_fn(result);
-      // Update the next ticket and send a signal to other workers in line.
-      ++ticket_num_;
-      ticket_update_.notify_all();
+  // Called by a worker of an elastic pool which found no job for
+  // idle_timeout_. Returns true if it should exit.
+  bool RetireIdle() {
+    int num_workers = num_workers_.load();
+    while (num_workers > min_workers_.load()) {
+      if (num_workers_.compare_exchange_weak(num_workers, num_workers - 1)) {
+        return true;
+      }
     }
+    return false;
+  }
+
+  void Worker(WorkerThread* self) {
+    // The clock is only read for limit_controller_ and stats_.
+    const bool timed = limit_controller_ || stats_;
+    std::chrono::steady_clock::time_point idle_since;
+    if (timed) {
+      idle_since = std::chrono::steady_clock::now();
+    }
+    while (true) {
+      std::optional<Job> job_opt =
+          max_workers_ > 0
+              ? fn_queue_.Pop(self->index,
+                              std::chrono::steady_clock::now() + idle_timeout_)
+              : fn_queue_.Pop(self->index);
+      if (!job_opt.has_value()) {
+        if (fn_queue_.closed() || RetireIdle()) {
+          break;
+        }
+        continue;
+      }
+      if (!job_opt->job_fn) {
+        // Retired by Resize().
+        break;
+      }
+      std::chrono::steady_clock::time_point start;
+      if (timed) {
+        start = std::chrono::steady_clock::now();
+        RecordIdle(idle_since, start, *job_opt);
+      }
+      if (max_workers_ > 0) {
+        ++busy_workers_;
+        Run(*job_opt, self->latency.get());
+        --busy_workers_;
+      } else {
+        Run(*job_opt, self->latency.get());
+      }
+      if (timed) {
+        idle_since = std::chrono::steady_clock::now();
+        if (stats_) {
+          AddTime(kBusyNs, idle_since - start);
+        }
+      }
+    }
+    // Jobs pushed by this worker's jobs to its deque are not stolen once it
+    // stops looking for jobs. Finish them.
+    while (std::optional<Job> job = fn_queue_.PopOwn(self->index)) {
+      if (!job->job_fn) {
+        // Another retirement, taken along from the shared queue in the same
+        // batch. Leave it to the remaining workers.
+        fn_queue_.Requeue(std::move(*job));
+        continue;
+      }
+      Run(*job, self->latency.get());
+    }
+    std::lock_guard<std::mutex> lck(workers_mtx_);
+    self->exited = true;
+    worker_exited_.notify_all();
+  }
+
+  // Runs the job, and delivers its result in turn. Records the latencies of
+  // the job to latency, if set.
+  void Run(Job& job, OrderedThreadPoolLatencies* latency) {
+    if (aborted_) {
+      return;
+    }
+    pool_trace::Record(pool_trace::EventType::kDequeue, job.job_id);
+    std::chrono::steady_clock::time_point started_at;
+    if (latency) {
+      started_at = std::chrono::steady_clock::now();
+      latency->queue.Record(started_at - job.queued_at);
+    }
+    // This runs parallelly across all threads.
+    pool_trace::Record(pool_trace::EventType::kJobBegin, job.job_id);
+    ReturnType result =
+        cancel_pending_.load(std::memory_order_acquire) ? Cancelled(job)
+                                                         : RunJobFn(job);
+    pool_trace::Record(pool_trace::EventType::kJobEnd, job.job_id);
+    std::chrono::steady_clock::time_point finished_at;
+    if (latency) {
+      finished_at = std::chrono::steady_clock::now();
+      latency->run.Record(finished_at - started_at);
+    }
+
+    if (reorder_buffer_ || job.line != &line_) {
+      Reorder(job, std::move(result), finished_at, latency);
+      return;
+    }
+
+    // Wait till our turn comes.
+    auto my_turn = [this, &job] {
+      return line_.ticket_num.load(std::memory_order_acquire) == job.job_id ||
+             aborted_;
+    };
+    // Only a wait which is not over right away is measured and traced.
+    std::chrono::steady_clock::time_point wait_start;
+    const bool must_wait = (stats_ || pool_trace::kEnabled) && !my_turn();
+    if (must_wait) {
+      pool_trace::Record(pool_trace::EventType::kTicketWaitBegin, job.job_id);
+      if (stats_) wait_start = std::chrono::steady_clock::now();
+    }
+    SpinUntil(wait_policy_, my_turn);
+    std::unique_lock<std::mutex> lck(line_.mtx);
+    TicketSlotFor(job.job_id).turn.wait(lck, my_turn);
+    if (must_wait) {
+      if (stats_) {
+        AddTime(kTicketWaitNs, std::chrono::steady_clock::now() - wait_start);
+      }
+      pool_trace::Record(pool_trace::EventType::kTicketWaitEnd, job.job_id);
+    }
+    if (aborted_) {
+      return;
+    }
+    std::chrono::steady_clock::time_point delivered_at;
+    if (latency) {
+      delivered_at = std::chrono::steady_clock::now();
+      latency->reorder.Record(delivered_at - finished_at);
+    }
+    // Perform the second part of the task. The ticket keeps the others
+    // waiting, so the lock is not needed meanwhile. Releasing it lets the
+    // completion e.g. resume a coroutine which submits more jobs.
+    lck.unlock();
+    pool_trace::Record(pool_trace::EventType::kCompletionBegin, job.job_id);
+    job.completion_fn(std::move(result));
+    pool_trace::Record(pool_trace::EventType::kCompletionEnd, job.job_id);
+    if (latency) {
+      latency->completion.Record(std::chrono::steady_clock::now() -
+                                 delivered_at);
+    }
+    // Update the next ticket and wake up the worker holding it, if it is
+    // waiting. The others keep sleeping.
+    lck.lock();
+    line_.ticket_num.store(job.job_id + 1);
+    TicketSlotFor(job.job_id + 1).turn.notify_all();
+    lck.unlock();
+    NotifyDelivered();
+    ReleaseCost(job.cost);
+  }
+
+  // Calls the job_fn of job, counting it in stats_.
+  ReturnType RunJobFn(Job& job) {
+    if (!stats_) {
+      return job.job_fn();
+    }
+    stats_->Add(kStarted, 1);
+    ReturnType result = job.job_fn();
+    stats_->Add(kCompleted, 1);
+    return result;
+  }
+
+  // Where the worker holding job_id waits for its turn.
+  struct alignas(64) TicketSlot {
+    std::condition_variable turn;
+  };
+
+  TicketSlot& TicketSlotFor(size_t job_id) {
+    return ticket_slots_[job_id & ticket_slot_mask_];
+  }
+
+  // Hands over a finished job without waiting for its ticket. If the job is
+  // next in line, delivers it along with any parked results that follow it.
+  // Otherwise parks the result for whichever thread fills the gap. The
+  // latencies of the results delivered are recorded to latency, if set.
+  void Reorder(Job& job, ReturnType result,
+               std::chrono::steady_clock::time_point finished_at,
+               OrderedThreadPoolLatencies* latency) {
+    TicketLine& line = *job.line;
+    std::unique_lock<std::mutex> lck(line.mtx);
+    if (aborted_) {
+      return;
+    }
+    if (line.draining || job.job_id != line.ticket_num) {
+      Park(line, job.job_id,
+           Finished{std::move(result), std::move(job.completion_fn), job.cost,
+                    finished_at});
+      return;
+    }
+    line.draining = true;
+    Finished next{std::move(result), std::move(job.completion_fn), job.cost,
+                  finished_at};
+    std::vector<ReturnType> batch;
+    // The job_id of next.
+    size_t job_id = job.job_id;
+    while (true) {
+      int64_t cost = next.cost;
+      std::chrono::steady_clock::time_point delivered_at;
+      if (latency) {
+        delivered_at = std::chrono::steady_clock::now();
+        latency->reorder.Record(delivered_at - next.finished_at);
+      }
+      if (!next.completion_fn) {
+        // Take along the consecutive parked results which also go to the
+        // batch completion.
+        batch.push_back(std::move(next.result));
+        size_t ticket = job_id + 1;
+        while (batch.size() < (size_t)max_completion_batch_) {
+          std::optional<Finished>* slot = ParkedAt(line, ticket);
+          if (slot == nullptr || (*slot)->completion_fn) break;
+          batch.push_back(std::move((*slot)->result));
+          cost += (*slot)->cost;
+          if (latency) {
+            latency->reorder.Record(delivered_at - (*slot)->finished_at);
+          }
+          slot->reset();
+          ++ticket;
+        }
+      }
+      // Deliver outside the lock, so that other workers can park meanwhile.
+      // The draining flag keeps the deliveries serialized.
+      lck.unlock();
+      size_t num_delivered = std::max<size_t>(1, batch.size());
+      pool_trace::Record(pool_trace::EventType::kCompletionBegin, job_id);
+      if (batch.empty()) {
+        next.completion_fn(std::move(next.result));
+      } else {
+        batch_completion_(batch);
+        batch.clear();
+      }
+      pool_trace::Record(pool_trace::EventType::kCompletionEnd, job_id);
+      if (latency) {
+        latency->completion.Record(std::chrono::steady_clock::now() -
+                                   delivered_at);
+      }
+      ReleaseCost(cost);
+      lck.lock();
+      job_id = line.ticket_num += num_delivered;
+      NotifyDelivered();
+      if (aborted_) break;
+      std::optional<Finished>* slot = ParkedAt(line, job_id);
+      if (slot == nullptr) break;
+      next = std::move(**slot);
+      slot->reset();
+    }
+    line.draining = false;
+  }
+
+  // The parked result for job_id, or null if there is none. Must hold
+  // line.mtx.
+  static std::optional<Finished>* ParkedAt(TicketLine& line, size_t job_id) {
+    std::vector<std::optional<Finished>>& ring = line.reorder_ring;
+    if (ring.empty()) return nullptr;
+    std::optional<Finished>& slot = ring[job_id & (ring.size() - 1)];
+    return slot.has_value() ? &slot : nullptr;
+  }
+
+  // Drops the parked results of line.
+  static void ClearParked(TicketLine& line) {
+    std::vector<std::optional<Finished>> ring;
+    {
+      std::lock_guard<std::mutex> lck(line.mtx);
+      ring.swap(line.reorder_ring);
+    }
+  }
+
+  // Stores a result which arrived ahead of its turn. Must hold line.mtx.
+  void Park(TicketLine& line, size_t job_id, Finished finished) {
+    std::vector<std::optional<Finished>>& ring = line.reorder_ring;
+    size_t ticket = line.ticket_num;
+    size_t distance = job_id - ticket;
+    if (distance >= ring.size()) {
+      // Grow to the next power of two, keeping the parked results at their
+      // job_id modulo the new size.
+      size_t new_size = std::max<size_t>(ring.size(), 16);
+      while (distance >= new_size) new_size *= 2;
+      std::vector<std::optional<Finished>> grown(new_size);
+      for (size_t id = ticket; id < ticket + ring.size(); ++id) {
+        grown[id & (new_size - 1)] = std::move(ring[id & (ring.size() - 1)]);
+      }
+      ring = std::move(grown);
+    }
+    ring[job_id & (ring.size() - 1)] = std::move(finished);
   }
 
-  // The worker threads are initialized on construction and maintained.
-  std::vector<std::thread> workers_;
   // Queue of functions to execute.
-  std::queue<Job> fn_queue_;
-  std::mutex fn_queue_mtx_;
-  std::condition_variable job_added_;
-  std::condition_variable job_removed_;
-  int max_queue_size_;
-  // Incremental job_id passed to each job.
-  size_t job_count_ = 0;
-
-  // Ticket system to ensure chronological delivery of jobs. The next job
-  // with job_id matching this will proceed with completion_fn().
-  size_t ticket_num_ = 0;
-  // The mutex to lock for second function.
-  std::mutex ticket_mtx_;
-  std::condition_variable ticket_update_;
-
-  // If true, the worker threads should stop.
-  bool terminate_now_ = false;
+  JobQueue<Job> fn_queue_;
+
+  // False if constructed with 0 workers, to run jobs on the calling thread.
+  const bool threaded_;
+  // An elastic pool keeps between min_workers_ and max_workers_ workers. Not
+  // elastic if max_workers_ is 0.
+  std::atomic<int> min_workers_;
+  const int max_workers_;
+  const std::chrono::milliseconds idle_timeout_;
+  // Guards workers_ and retired_latency_, and serializes adding and retiring
+  // workers.
+  mutable std::mutex workers_mtx_;
+  // The worker threads are initialized on construction and maintained.
+  std::vector<std::unique_ptr<WorkerThread>> workers_;
+  // Notified under workers_mtx_ when a worker exits.
+  std::condition_variable worker_exited_;
+  // Latencies recorded by the workers which have exited.
+  std::unique_ptr<OrderedThreadPoolLatencies> retired_latency_;
+  // Workers which are not retiring.
+  std::atomic<int> num_workers_{0};
+  // Workers running a job. Only counted for an elastic pool.
+  std::atomic<int> busy_workers_{0};
+
+  // Order of the jobs submitted without a key.
+  TicketLine line_;
+  // Condition variables for the ticket wait of line_, indexed by job_id modulo
+  // the number of slots, a power of two. Used with line_.mtx.
+  std::unique_ptr<TicketSlot[]> ticket_slots_;
+  size_t ticket_slot_mask_;
+  const WaitPolicy wait_policy_;
+  // The limit on pending jobs, unless limit_controller_ adjusts it.
+  const int max_pending_jobs_;
+  std::unique_ptr<QueueLimitController> limit_controller_;
+
+  // Sum of the costs of the jobs submitted and not yet delivered, and its
+  // limit.
+  std::mutex cost_mtx_;
+  std::condition_variable cost_released_;
+  int64_t pending_cost_ = 0;
+  const int64_t max_pending_cost_;
+
+  // Most jobs submitted and not yet delivered per TicketLine.
+  const int max_in_flight_;
+  // Counts jobs and time, if OrderedThreadPoolOptions::collect_stats is set.
+  std::unique_ptr<ShardedCounters<kNumStatsCounters>> stats_;
+  // If set, each worker records OrderedThreadPoolLatencies.
+  const bool collect_latency_;
+  // Producers waiting for the window of a line to open, and WaitIdle(), wait
+  // on delivered_.
+  std::mutex delivery_mtx_;
+  std::condition_variable delivered_;
+  std::atomic<int> delivery_waiters_{0};
+
+  // If true, workers park early results in the reorder ring of line_ instead
+  // of waiting.
+  const bool reorder_buffer_;
+
+  // Orders of the jobs submitted with a key, one per bucket of keys.
+  const int num_key_buckets_;
+  std::unique_ptr<TicketLine[]> key_lines_;
+
+  // Set by Shutdown() for jobs which have not started.
+  std::atomic<bool> cancel_pending_{false};
+  JobFnT cancelled_result_;
+  std::atomic<bool> aborted_{false};
+  CancellationToken cancellation_token_;
+
+  // Receives the results of jobs without a completion_fn, if set.
+  BatchCompletionFnT batch_completion_;
+  const int max_completion_batch_;
 };
 
 #endif  // ORDERED_THREAD_POOL_H
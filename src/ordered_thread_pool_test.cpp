@@ -16,6 +16,16 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
 // Runs through a given a thread pool. The maximum value seen so far is held at
 // *max. Does not wait for the thread pool to finish.
 void RunTest1(int num_entries, OrderedThreadPool<int>* pool, int* max) {
@@ -60,6 +70,1169 @@ TEST(OrderedThreadPoolTest, ThreadedWithQueueLimit) {
   ASSERT_EQ(max, 49);
 }
 
+// More workers than jobs in the queue, so that many wait for their tickets at
+// once.
+TEST(OrderedThreadPoolTest, ManyWorkers) {
+  int max = 0;
+  {
+    OrderedThreadPool<int> thread_pool{64, 0};
+    RunTest1(2000, &thread_pool, &max);
+  }
+  ASSERT_EQ(max, 1999);
+}
+
+TEST(OrderedThreadPoolTest, ReorderBuffer) {
+  int max = 0;
+  {
+    OrderedThreadPool<int> thread_pool{10, {.reorder_buffer = true}};
+    RunTest1(500, &thread_pool, &max);
+  }
+  ASSERT_EQ(max, 499);
+}
+
+// With a reorder buffer, a slow head job must not stop other workers from
+// picking up new jobs.
+TEST(OrderedThreadPoolTest, ReorderBufferDoesNotBlockWorkers) {
+  std::atomic<int> num_done{0};
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{
+        2, {.max_pending_jobs = 0, .reorder_buffer = true}};
+    thread_pool.Do(
+        [&num_done] {
+          // Only one other worker exists. Wait for it to finish everything
+          // else, which would never happen if it waited for this job.
+          auto deadline =
+              std::chrono::steady_clock::now() + std::chrono::seconds(10);
+          while (num_done < 100 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+          return num_done.load();
+        },
+        [&delivered](int k) { delivered.push_back(k); });
+    for (int i = 1; i <= 100; ++i) {
+      thread_pool.Do(
+          [&num_done, i] {
+            ++num_done;
+            return i;
+          },
+          [&delivered](int k) { delivered.push_back(k); });
+    }
+  }
+  ASSERT_EQ(delivered.size(), 101);
+  // The head job saw all of the others finish.
+  ASSERT_EQ(delivered[0], 100);
+  for (int i = 1; i <= 100; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+TEST(OrderedThreadPoolTest, LockFreeQueue) {
+  int max = 0;
+  {
+    OrderedThreadPool<int> thread_pool{10, {.max_pending_jobs = 5,
+                                            .lock_free_queue = true}};
+    RunTest1(500, &thread_pool, &max);
+  }
+  ASSERT_EQ(max, 499);
+}
+
+// Several threads calling Do() still see their own jobs complete in order.
+TEST(OrderedThreadPoolTest, LockFreeQueueMultiplePushers) {
+  std::vector<int> last_seen(4, -1);
+  {
+    OrderedThreadPool<int> thread_pool{4, {.max_pending_jobs = 2,
+                                           .lock_free_queue = true}};
+    std::vector<std::thread> pushers;
+    for (int p = 0; p < 4; ++p) {
+      pushers.emplace_back([&thread_pool, &last_seen, p] {
+        for (int i = 0; i < 200; ++i) {
+          thread_pool.Do([i] { return i; },
+                         [&last_seen, p](int k) {
+                           ASSERT_EQ(k, last_seen[p] + 1);
+                           last_seen[p] = k;
+                         });
+        }
+      });
+    }
+    for (std::thread& t : pushers) {
+      t.join();
+    }
+  }
+  ASSERT_EQ(last_seen, std::vector<int>(4, 199));
+}
+
+TEST(OrderedThreadPoolTest, WorkStealing) {
+  int max = 0;
+  {
+    OrderedThreadPool<int> thread_pool{10, {.max_pending_jobs = 5,
+                                            .work_stealing = true}};
+    RunTest1(500, &thread_pool, &max);
+  }
+  ASSERT_EQ(max, 499);
+}
+
+// Jobs submitted from inside a job go to the worker's own deque, and may be
+// stolen from there. Their completions are still ordered.
+TEST(OrderedThreadPoolTest, WorkStealingNestedDo) {
+  std::vector<int> delivered;
+  std::atomic<int> num_run{0};
+  {
+    OrderedThreadPool<int> thread_pool{4, {.max_pending_jobs = 0,
+                                           .work_stealing = true}};
+    for (int i = 0; i < 10; ++i) {
+      thread_pool.Do(
+          [&thread_pool, &delivered, &num_run, i] {
+            for (int j = 0; j < 10; ++j) {
+              thread_pool.Do(
+                  [&num_run, i, j] {
+                    ++num_run;
+                    return 100 + i * 10 + j;
+                  },
+                  [&delivered](int k) { delivered.push_back(k); });
+            }
+            ++num_run;
+            return i;
+          },
+          [&delivered](int k) { delivered.push_back(k); });
+    }
+  }
+  ASSERT_EQ(num_run, 110);
+  ASSERT_EQ(delivered.size(), 110);
+}
+
+TEST(OrderedThreadPoolTest, WorkStealingWithLockFreeQueue) {
+  int max = 0;
+  {
+    OrderedThreadPool<int> thread_pool{
+        10, {.max_pending_jobs = 5,
+             .lock_free_queue = true,
+             .work_stealing = true}};
+    RunTest1(500, &thread_pool, &max);
+  }
+  ASSERT_EQ(max, 499);
+}
+
+TEST(OrderedThreadPoolTest, SpinningWaitPolicy) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{
+            .max_pending_jobs = 2,
+            .wait_policy = {.spin_iterations = 100, .yield_iterations = 10}},
+        OrderedThreadPoolOptions{.max_pending_jobs = 2,
+                                 .lock_free_queue = true,
+                                 .wait_policy = {.spin_iterations = 100}},
+        OrderedThreadPoolOptions{.max_pending_jobs = 2,
+                                 .work_stealing = true,
+                                 .wait_policy = {.yield_iterations = 10}}}) {
+    int max = 0;
+    {
+      OrderedThreadPool<int> thread_pool{4, options};
+      RunTest1(500, &thread_pool, &max);
+    }
+    ASSERT_EQ(max, 499);
+  }
+}
+
+// Completions are ordered within each key.
+TEST(OrderedThreadPoolTest, PerKeyOrder) {
+  constexpr int kNumKeys = 10;
+  std::vector<int> last_seen(kNumKeys, -1);
+  std::mutex mtx;
+  {
+    OrderedThreadPool<int> thread_pool{8, {.max_pending_jobs = 4,
+                                           .num_key_buckets = 4}};
+    for (int i = 0; i < 1000; ++i) {
+      int key = i % kNumKeys;
+      thread_pool.Do(
+          key,
+          [i] {
+            if (i % 7 == 0) {
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            return i;
+          },
+          [&last_seen, &mtx, key](int k) {
+            std::lock_guard<std::mutex> lck(mtx);
+            ASSERT_GT(k, last_seen[key]);
+            last_seen[key] = k;
+          });
+    }
+  }
+  for (int key = 0; key < kNumKeys; ++key) {
+    ASSERT_EQ(last_seen[key], 990 + key);
+  }
+}
+
+// A slow job only holds up the completions of its own key.
+TEST(OrderedThreadPoolTest, PerKeyOrderIsIndependent) {
+  std::atomic<bool> other_key_done{false};
+  std::vector<std::string> delivered;
+  std::mutex mtx;
+  {
+    OrderedThreadPool<int> thread_pool{2, 0};
+    // Integers hash to themselves, so these land in different buckets.
+    thread_pool.Do(
+        0,
+        [&other_key_done] {
+          auto deadline =
+              std::chrono::steady_clock::now() + std::chrono::seconds(10);
+          while (!other_key_done &&
+                 std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+          return 0;
+        },
+        [&](int) {
+          std::lock_guard<std::mutex> lck(mtx);
+          delivered.push_back("slow");
+        });
+    thread_pool.Do(
+        1, [] { return 0; },
+        [&](int) {
+          {
+            std::lock_guard<std::mutex> lck(mtx);
+            delivered.push_back("fast");
+          }
+          other_key_done = true;
+        });
+  }
+  ASSERT_EQ(delivered, (std::vector<std::string>{"fast", "slow"}));
+}
+
+// With no buckets requested, all keys share one order.
+TEST(OrderedThreadPoolTest, PerKeyOrderNoBuckets) {
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{4, {.max_pending_jobs = 0,
+                                           .num_key_buckets = 0}};
+    for (int i = 0; i < 50; ++i) {
+      thread_pool.Do(
+          i % 3, [i] { return i; },
+          [&delivered](int k) { delivered.push_back(k); });
+    }
+  }
+  ASSERT_EQ(delivered.size(), 50);
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+TEST(OrderedThreadPoolTest, BatchCompletion) {
+  std::vector<int> delivered;
+  int num_batches = 0;
+  {
+    OrderedThreadPool<int> thread_pool{
+        4, {.max_pending_jobs = 0, .max_completion_batch = 8},
+        [&](std::vector<int>& results) {
+          ASSERT_LE(results.size(), 8);
+          delivered.insert(delivered.end(), results.begin(), results.end());
+          ++num_batches;
+        }};
+    for (int i = 0; i < 1000; ++i) {
+      thread_pool.Do(
+          [i] {
+            if (i % 50 == 0) {
+              // Lets the following results pile up.
+              std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return i;
+          },
+          nullptr);
+    }
+  }
+  ASSERT_EQ(delivered.size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+  ASSERT_LT(num_batches, 1000);
+}
+
+// Jobs with their own completion_fn are delivered in order between batches.
+TEST(OrderedThreadPoolTest, BatchCompletionMixed) {
+  std::vector<int> delivered;
+  auto record = [&delivered](std::vector<int>& results) {
+    delivered.insert(delivered.end(), results.begin(), results.end());
+  };
+  for (int num_workers : {0, 4}) {
+    delivered.clear();
+    {
+      OrderedThreadPool<int> thread_pool{num_workers, {}, record};
+      for (int i = 0; i < 200; ++i) {
+        if (i % 3 == 0) {
+          thread_pool.Do([i] { return i; },
+                         [&delivered](int k) { delivered.push_back(-k); });
+        } else {
+          thread_pool.Do([i] { return i; }, nullptr);
+        }
+      }
+    }
+    ASSERT_EQ(delivered.size(), 200);
+    for (int i = 0; i < 200; ++i) {
+      ASSERT_EQ(delivered[i], i % 3 == 0 ? -i : i);
+    }
+  }
+}
+
+// Both the jobs and their results may be move-only.
+TEST(OrderedThreadPoolTest, MoveOnly) {
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<std::unique_ptr<int>> thread_pool{4, 2};
+    for (int i = 0; i < 50; ++i) {
+      auto input = std::make_unique<int>(i);
+      thread_pool.Do([input = std::move(input)]() mutable {
+                       return std::move(input);
+                     },
+                     [&delivered](std::unique_ptr<int> k) {
+                       delivered.push_back(*k);
+                     });
+    }
+  }
+  ASSERT_EQ(delivered.size(), 50);
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+TEST(OrderedThreadPoolTest, DoAsync) {
+  OrderedThreadPool<int> thread_pool{4, 2};
+  std::vector<PoolFuture<int>> futures;
+  for (int i = 0; i < 100; ++i) {
+    futures.push_back(thread_pool.DoAsync([i] { return i * i; }));
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(futures[i].Get(), i * i);
+  }
+}
+
+// Continuations run in the order of submission, like completion_fn.
+TEST(OrderedThreadPoolTest, DoAsyncThen) {
+  std::vector<int> delivered;
+  std::vector<PoolFuture<void>> futures;
+  {
+    OrderedThreadPool<int> thread_pool{4, 0};
+    for (int i = 0; i < 100; ++i) {
+      futures.push_back(thread_pool.DoAsync([i] { return i; })
+                            .Then([&delivered](int k) {
+                              delivered.push_back(k);
+                            }));
+    }
+  }
+  ASSERT_EQ(delivered.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(delivered[i], i);
+    ASSERT_TRUE(futures[i].Ready());
+  }
+}
+
+// A continuation submits a dependent request from a worker. It must not block
+// on the full queue while the other workers wait for their turn.
+TEST(OrderedThreadPoolTest, DoAsyncThenChained) {
+  std::atomic<int> num_done{0};
+  OrderedThreadPool<int> thread_pool{2, 1};
+  for (int i = 0; i < 2000; ++i) {
+    thread_pool.DoAsync([i] { return i; })
+        .Then([&thread_pool, &num_done, i](int k) {
+          thread_pool.DoAsync([k] { return k + 1; })
+              .Then([&num_done, i](int j) {
+                if (j == i + 1) ++num_done;
+              });
+        });
+  }
+  thread_pool.WaitIdle();
+  ASSERT_EQ(num_done, 2000);
+}
+
+TEST(OrderedThreadPoolTest, DoBatch) {
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{4, 3};
+    for (int batch = 0; batch < 10; ++batch) {
+      std::vector<OrderedThreadPool<int>::BatchJob> jobs;
+      for (int i = 0; i < 50; ++i) {
+        int k = batch * 50 + i;
+        jobs.emplace_back([k] { return k; },
+                          [&delivered](int k) { delivered.push_back(k); });
+      }
+      thread_pool.DoBatch(std::move(jobs));
+    }
+  }
+  ASSERT_EQ(delivered.size(), 500);
+  for (int i = 0; i < 500; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+TEST(OrderedThreadPoolTest, DoRange) {
+  std::vector<int> input(1000);
+  for (int i = 0; i < 1000; ++i) input[i] = i;
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 7},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0},
+        OrderedThreadPoolOptions{.max_pending_jobs = 7,
+                                 .lock_free_queue = true},
+        OrderedThreadPoolOptions{.max_pending_jobs = 7,
+                                 .work_stealing = true}}) {
+    std::vector<int> delivered;
+    {
+      OrderedThreadPool<int> thread_pool{4, options};
+      thread_pool.DoRange(input.begin(), input.end(),
+                          [](int k) { return 2 * k; },
+                          [&delivered](int k) { delivered.push_back(k); });
+    }
+    ASSERT_EQ(delivered.size(), 1000);
+    for (int i = 0; i < 1000; ++i) {
+      ASSERT_EQ(delivered[i], 2 * i);
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, DoRangeUnthreaded) {
+  std::vector<int> delivered;
+  OrderedThreadPool<int> thread_pool{0};
+  std::vector<int> input{1, 2, 3};
+  thread_pool.DoRange(input.begin(), input.end(), [](int k) { return -k; },
+                      [&delivered](int k) { delivered.push_back(k); });
+  ASSERT_EQ(delivered, (std::vector<int>{-1, -2, -3}));
+}
+
+// Elements may be moved into the jobs.
+TEST(OrderedThreadPoolTest, DoRangeMoveOnly) {
+  std::vector<std::unique_ptr<int>> input;
+  for (int i = 0; i < 20; ++i) input.push_back(std::make_unique<int>(i));
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{4, 2};
+    thread_pool.DoRange(std::make_move_iterator(input.begin()),
+                        std::make_move_iterator(input.end()),
+                        [](std::unique_ptr<int> k) { return *k; },
+                        [&delivered](int k) { delivered.push_back(k); });
+  }
+  ASSERT_EQ(delivered.size(), 20);
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+// TryDo() and DoFor() refuse jobs while the queue is full, without taking a
+// ticket, so that the accepted jobs are still delivered in order.
+TEST(OrderedThreadPoolTest, TryDo) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 2},
+        OrderedThreadPoolOptions{.max_pending_jobs = 2,
+                                 .lock_free_queue = true},
+        OrderedThreadPoolOptions{.max_pending_jobs = 2,
+                                 .work_stealing = true}}) {
+    std::vector<int> delivered;
+    std::atomic<bool> started{false};
+    std::atomic<bool> release{false};
+    int num_accepted = 0;
+    {
+      OrderedThreadPool<int> thread_pool{1, options};
+      auto on_completion = [&delivered](int k) { delivered.push_back(k); };
+      thread_pool.Do(
+          [&] {
+            started = true;
+            while (!release) std::this_thread::yield();
+            return 0;
+          },
+          on_completion);
+      while (!started) std::this_thread::yield();
+      int next = 1;
+      while (next < 100 && thread_pool.TryDo([k = next] { return k; },
+                                             on_completion)) {
+        ++next;
+      }
+      ASSERT_LT(next, 100);
+      ASSERT_FALSE(thread_pool.DoFor(std::chrono::milliseconds(5),
+                                     [k = next] { return k; },
+                                     on_completion));
+      release = true;
+      ASSERT_TRUE(thread_pool.DoUntil(
+          std::chrono::system_clock::now() + std::chrono::seconds(10),
+          [k = next] { return k; }, on_completion));
+      ++next;
+      // A refused job is left with the caller for another attempt.
+      MoveOnlyFunction<int()> fn = [k = next] { return k; };
+      MoveOnlyFunction<void(int)> completion = on_completion;
+      while (!thread_pool.TryDo(std::move(fn), std::move(completion))) {
+        ASSERT_TRUE(fn);
+        ASSERT_TRUE(completion);
+        std::this_thread::yield();
+      }
+      num_accepted = next + 1;
+    }
+    ASSERT_EQ(delivered.size(), num_accepted);
+    for (int i = 0; i < num_accepted; ++i) {
+      ASSERT_EQ(delivered[i], i);
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, TryDoUnthreaded) {
+  int delivered = 0;
+  OrderedThreadPool<int> thread_pool{0};
+  ASSERT_TRUE(thread_pool.TryDo([] { return 3; },
+                                [&delivered](int k) { delivered = k; }));
+  ASSERT_EQ(delivered, 3);
+}
+
+// The cost of jobs is counted till their completion has returned.
+TEST(OrderedThreadPoolTest, MaxPendingCost) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_pending_cost = 10},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_pending_cost = 10,
+                                 .reorder_buffer = true}}) {
+    std::atomic<int> outstanding{0};
+    std::atomic<int> num_over_limit{0};
+    std::vector<int> delivered;
+    {
+      OrderedThreadPool<int> thread_pool{8, options};
+      for (int i = 0; i < 100; ++i) {
+        // Every tenth job costs more than the limit, and runs on its own.
+        int cost = i % 10 == 0 ? 100 : 4;
+        thread_pool.Do(
+            [&, i, cost] {
+              int now = outstanding += cost;
+              if (now > 10 && now != 100) ++num_over_limit;
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+              return i;
+            },
+            [&, cost](int k) {
+              outstanding -= cost;
+              delivered.push_back(k);
+            },
+            cost);
+      }
+    }
+    ASSERT_EQ(num_over_limit, 0);
+    ASSERT_EQ(delivered.size(), 100);
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(delivered[i], i);
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, MaxPendingCostBatchCompletion) {
+  std::vector<int> delivered;
+  std::atomic<int> outstanding{0};
+  std::atomic<int> max_outstanding{0};
+  {
+    OrderedThreadPool<int> thread_pool{
+        4, {.max_pending_jobs = 0, .max_pending_cost = 3},
+        [&](std::vector<int>& batch) {
+          outstanding -= batch.size();
+          delivered.insert(delivered.end(), batch.begin(), batch.end());
+        }};
+    for (int i = 0; i < 100; ++i) {
+      thread_pool.Do(
+          [&, i] {
+            int now = ++outstanding;
+            int max = max_outstanding;
+            while (now > max &&
+                   !max_outstanding.compare_exchange_weak(max, now)) {
+            }
+            return i;
+          },
+          nullptr, 1);
+    }
+  }
+  ASSERT_LE(max_outstanding, 3);
+  ASSERT_EQ(delivered.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+// A slow job holds back at most max_in_flight jobs, however many workers are
+// free.
+TEST(OrderedThreadPoolTest, MaxInFlight) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 0, .max_in_flight = 4},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_in_flight = 4,
+                                 .reorder_buffer = true},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_in_flight = 4,
+                                 .work_stealing = true}}) {
+    std::atomic<int> outstanding{0};
+    int max_outstanding = 0;
+    std::vector<int> delivered;
+    {
+      OrderedThreadPool<int> thread_pool{8, options};
+      for (int i = 0; i < 100; ++i) {
+        thread_pool.Do(
+            [i] {
+              if (i % 20 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+              }
+              return i;
+            },
+            [&](int k) {
+              --outstanding;
+              delivered.push_back(k);
+            });
+        max_outstanding = std::max<int>(max_outstanding, ++outstanding);
+      }
+      std::vector<OrderedThreadPool<int>::BatchJob> jobs;
+      for (int i = 100; i < 120; ++i) {
+        jobs.emplace_back([i] { return i; },
+                          [&delivered](int k) { delivered.push_back(k); });
+      }
+      thread_pool.DoBatch(std::move(jobs));
+    }
+    ASSERT_LE(max_outstanding, 4);
+    ASSERT_EQ(delivered.size(), 120);
+    for (int i = 0; i < 120; ++i) {
+      ASSERT_EQ(delivered[i], i);
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, MaxInFlightTryDo) {
+  std::atomic<bool> release{false};
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{
+        4, {.max_pending_jobs = 0, .max_in_flight = 2}};
+    auto on_completion = [&delivered](int k) { delivered.push_back(k); };
+    thread_pool.Do(
+        [&release] {
+          while (!release) std::this_thread::yield();
+          return 0;
+        },
+        on_completion);
+    ASSERT_TRUE(thread_pool.TryDo([] { return 1; }, on_completion));
+    ASSERT_FALSE(thread_pool.TryDo([] { return 2; }, on_completion));
+    ASSERT_FALSE(thread_pool.DoFor(std::chrono::milliseconds(5),
+                                   [] { return 2; }, on_completion));
+    release = true;
+    thread_pool.Do([] { return 2; }, on_completion);
+  }
+  ASSERT_EQ(delivered, (std::vector<int>{0, 1, 2}));
+}
+
+// Completions which submit more jobs with the window full must not wait for
+// deliveries which only they could make.
+TEST(OrderedThreadPoolTest, MaxInFlightFromCompletion) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 0, .max_in_flight = 4},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_in_flight = 4,
+                                 .reorder_buffer = true}}) {
+    std::atomic<int> num_done{0};
+    OrderedThreadPool<int> thread_pool{2, options};
+    for (int i = 0; i < 4; ++i) {
+      thread_pool.Do(
+          [i] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            return i;
+          },
+          [&thread_pool, &num_done](int k) {
+            thread_pool.Do([k] { return k; }, [&num_done](int) { ++num_done; });
+          });
+    }
+    ASSERT_TRUE(thread_pool.WaitIdleFor(std::chrono::seconds(10)));
+    ASSERT_EQ(num_done, 4);
+  }
+}
+
+TEST(OrderedThreadPoolTest, MaxInFlightFromThen) {
+  std::atomic<int> num_done{0};
+  OrderedThreadPool<int> thread_pool{
+      2, {.max_pending_jobs = 0, .max_in_flight = 2}};
+  for (int i = 0; i < 100; ++i) {
+    thread_pool.DoAsync([i] { return i; })
+        .Then([&thread_pool, &num_done](int k) {
+          thread_pool.DoAsync([k] { return k + 1; }).Then([&num_done](int) {
+            ++num_done;
+          });
+        });
+  }
+  ASSERT_TRUE(thread_pool.WaitIdleFor(std::chrono::seconds(10)));
+  ASSERT_EQ(num_done, 100);
+}
+
+// Jobs piling up in the queue lower the adaptive limit.
+TEST(OrderedThreadPoolTest, AdaptivePendingJobsShrinks) {
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{
+        2, {.max_pending_jobs = 64,
+            .adaptive_pending_jobs = true,
+            .max_adaptive_pending_jobs = 64,
+            .target_queue_wait = std::chrono::milliseconds(1)}};
+    ASSERT_EQ(thread_pool.max_pending_jobs(), 64);
+    for (int i = 0; i < 200; ++i) {
+      thread_pool.Do(
+          [i] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return i;
+          },
+          [&delivered](int k) { delivered.push_back(k); });
+    }
+    ASSERT_LT(thread_pool.max_pending_jobs(), 64);
+  }
+  ASSERT_EQ(delivered.size(), 200);
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+// Workers waiting on a slow producer raise the adaptive limit.
+TEST(OrderedThreadPoolTest, AdaptivePendingJobsGrows) {
+  OrderedThreadPool<int> thread_pool{
+      2, {.max_pending_jobs = 1, .adaptive_pending_jobs = true}};
+  for (int i = 0; i < 50; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_GT(thread_pool.max_pending_jobs(), 1);
+}
+
+// Idleness is weighed against the workers left after Resize(), so that a slow
+// producer still raises the adaptive limit.
+TEST(OrderedThreadPoolTest, AdaptivePendingJobsResize) {
+  OrderedThreadPool<int> thread_pool{
+      64, {.max_pending_jobs = 1, .adaptive_pending_jobs = true}};
+  thread_pool.Resize(1);
+  for (int i = 0; i < 50; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_GT(thread_pool.max_pending_jobs(), 1);
+}
+
+TEST(OrderedThreadPoolTest, Resize) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 4},
+        OrderedThreadPoolOptions{.max_pending_jobs = 4,
+                                 .reorder_buffer = true},
+        OrderedThreadPoolOptions{.max_pending_jobs = 4,
+                                 .work_stealing = true,
+                                 .max_workers = 6}}) {
+    std::vector<int> delivered;
+    std::mutex mtx;
+    std::set<std::thread::id> threads;
+    {
+      OrderedThreadPool<int> thread_pool{2, options};
+      auto submit = [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+          thread_pool.Do(
+              [&, i] {
+                {
+                  std::lock_guard<std::mutex> lck(mtx);
+                  threads.insert(std::this_thread::get_id());
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                return i;
+              },
+              [&delivered](int k) { delivered.push_back(k); });
+        }
+      };
+      submit(0, 100);
+      thread_pool.Resize(6);
+      ASSERT_EQ(thread_pool.num_workers(), 6);
+      submit(100, 200);
+      thread_pool.Resize(1);
+      ASSERT_EQ(thread_pool.num_workers(), 1);
+      submit(200, 300);
+      thread_pool.Resize(3);
+      ASSERT_EQ(thread_pool.num_workers(), 3);
+      submit(300, 400);
+    }
+    ASSERT_GT(threads.size(), 2);
+    ASSERT_EQ(delivered.size(), 400);
+    for (int i = 0; i < 400; ++i) {
+      ASSERT_EQ(delivered[i], i);
+    }
+  }
+}
+
+// With work stealing, a worker takes a batch from the shared queue, which may
+// hold several retirements. Only one of them retires it.
+TEST(OrderedThreadPoolTest, ResizeWorkStealingQueuedJobs) {
+  std::atomic<bool> release{false};
+  std::atomic<int> num_started{0};
+  std::vector<int> delivered;
+  {
+    OrderedThreadPool<int> thread_pool{
+        3, {.max_pending_jobs = 0, .work_stealing = true}};
+    for (int i = 0; i < 3; ++i) {
+      thread_pool.Do(
+          [&, i] {
+            ++num_started;
+            while (!release) std::this_thread::yield();
+            return i;
+          },
+          [&delivered](int k) { delivered.push_back(k); });
+    }
+    while (num_started < 3) std::this_thread::yield();
+    thread_pool.Resize(1);
+    for (int i = 3; i < 23; ++i) {
+      thread_pool.Do([i] { return i; },
+                     [&delivered](int k) { delivered.push_back(k); });
+    }
+    release = true;
+    ASSERT_EQ(thread_pool.num_workers(), 1);
+  }
+  ASSERT_EQ(delivered.size(), 23);
+  for (int i = 0; i < 23; ++i) {
+    ASSERT_EQ(delivered[i], i);
+  }
+}
+
+// Growing reuses the deques of the workers retired just before.
+TEST(OrderedThreadPoolTest, ResizeWorkStealingShrinkThenGrow) {
+  std::atomic<bool> release{false};
+  OrderedThreadPool<int> thread_pool{
+      2, {.max_pending_jobs = 0, .work_stealing = true}};
+  for (int i = 0; i < 2; ++i) {
+    thread_pool.Do(
+        [&release] {
+          while (!release) std::this_thread::yield();
+          return 0;
+        },
+        [](int) {});
+  }
+  thread_pool.Resize(1);
+  ASSERT_EQ(thread_pool.num_workers(), 1);
+  release = true;
+  thread_pool.Resize(2);
+  ASSERT_EQ(thread_pool.num_workers(), 2);
+  thread_pool.WaitIdle();
+  ASSERT_EQ(thread_pool.num_workers(), 2);
+  ASSERT_EQ(thread_pool.DoAsync([] { return 5; }).Get(), 5);
+}
+
+// An elastic pool grows while all workers are busy, and shrinks back once
+// they are idle.
+TEST(OrderedThreadPoolTest, Elastic) {
+  std::atomic<bool> release{false};
+  std::atomic<int> num_started{0};
+  OrderedThreadPool<int> thread_pool{
+      1, {.max_pending_jobs = 0,
+          .max_workers = 4,
+          .idle_timeout = std::chrono::milliseconds(10)}};
+  for (int i = 0; i < 4; ++i) {
+    thread_pool.Do(
+        [&] {
+          ++num_started;
+          while (!release) std::this_thread::yield();
+          return 0;
+        },
+        [](int) {});
+    // Each job gets a worker of its own, added if all others are busy.
+    while (num_started <= i) std::this_thread::yield();
+  }
+  ASSERT_EQ(thread_pool.num_workers(), 4);
+  release = true;
+  for (int i = 0; i < 1000 && thread_pool.num_workers() > 1; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  ASSERT_EQ(thread_pool.num_workers(), 1);
+  // The remaining worker still runs jobs.
+  ASSERT_EQ(thread_pool.DoAsync([] { return 5; }).Get(), 5);
+}
+
+// The pool is reused across phases, each waited for with WaitIdle().
+TEST(OrderedThreadPoolTest, WaitIdle) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 4},
+        OrderedThreadPoolOptions{.max_pending_jobs = 4,
+                                 .reorder_buffer = true}}) {
+    OrderedThreadPool<int> thread_pool{4, options};
+    std::vector<int> delivered;
+    for (int phase = 0; phase < 5; ++phase) {
+      for (int i = 0; i < 20; ++i) {
+        thread_pool.Do(
+            [i] {
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+              return i;
+            },
+            [&delivered](int k) { delivered.push_back(k); });
+        thread_pool.Do(i % 4, [i] { return i; }, [](int) {});
+      }
+      thread_pool.WaitIdle();
+      ASSERT_EQ(delivered.size(), 20);
+      delivered.clear();
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, WaitIdleFor) {
+  std::atomic<bool> release{false};
+  OrderedThreadPool<int> thread_pool{2};
+  ASSERT_TRUE(thread_pool.WaitIdleFor(std::chrono::milliseconds(0)));
+  thread_pool.Do(
+      [&release] {
+        while (!release) std::this_thread::yield();
+        return 0;
+      },
+      [](int) {});
+  ASSERT_FALSE(thread_pool.WaitIdleFor(std::chrono::milliseconds(5)));
+  release = true;
+  ASSERT_TRUE(thread_pool.WaitIdleFor(std::chrono::seconds(10)));
+}
+
+// Queues a job which blocks till the pool is cancelled, and then num_jobs
+// which count how many of them run.
+void RunTillCancelled(OrderedThreadPool<int>& pool, int num_jobs,
+                      std::atomic<int>* num_run, std::vector<int>* delivered) {
+  std::atomic<bool> started{false};
+  auto deliver = [delivered](int k) { delivered->push_back(k); };
+  pool.Do(
+      [&started, token = pool.cancellation_token()] {
+        started = true;
+        while (!token.cancelled()) std::this_thread::yield();
+        return 0;
+      },
+      deliver);
+  while (!started) std::this_thread::yield();
+  for (int i = 1; i <= num_jobs; ++i) {
+    pool.Do(
+        [i, num_run] {
+          ++*num_run;
+          return i;
+        },
+        deliver);
+  }
+}
+
+TEST(OrderedThreadPoolTest, ShutdownCancelPending) {
+  for (bool reorder_buffer : {false, true}) {
+    std::atomic<int> num_run{0};
+    std::vector<int> delivered;
+    OrderedThreadPool<int> thread_pool{
+        1, {.max_pending_jobs = 0, .reorder_buffer = reorder_buffer}};
+    RunTillCancelled(thread_pool, 100, &num_run, &delivered);
+    thread_pool.Shutdown(ShutdownMode::kCancelPending, [] { return -1; });
+    // The running job finished. The others were cancelled, and delivered in
+    // order.
+    ASSERT_EQ(num_run, 0);
+    ASSERT_EQ(delivered.size(), 101);
+    ASSERT_EQ(delivered[0], 0);
+    for (int i = 1; i <= 100; ++i) {
+      ASSERT_EQ(delivered[i], -1);
+    }
+  }
+}
+
+TEST(OrderedThreadPoolTest, ShutdownAbort) {
+  for (bool reorder_buffer : {false, true}) {
+    std::atomic<int> num_run{0};
+    std::vector<int> delivered;
+    OrderedThreadPool<int> thread_pool{
+        1, {.max_pending_jobs = 0, .reorder_buffer = reorder_buffer}};
+    RunTillCancelled(thread_pool, 100, &num_run, &delivered);
+    thread_pool.Shutdown(ShutdownMode::kAbort);
+    ASSERT_EQ(num_run, 0);
+    ASSERT_TRUE(delivered.empty());
+  }
+}
+
+// A worker waiting for the ticket of an aborted job gives up.
+TEST(OrderedThreadPoolTest, ShutdownAbortTicketWait) {
+  std::atomic<int> num_run{0};
+  std::vector<int> delivered;
+  OrderedThreadPool<int> thread_pool{2, 0};
+  RunTillCancelled(thread_pool, 100, &num_run, &delivered);
+  while (num_run == 0) std::this_thread::yield();
+  thread_pool.Shutdown(ShutdownMode::kAbort);
+  ASSERT_EQ(num_run, 1);
+  ASSERT_TRUE(delivered.empty());
+}
+
+// Futures of the dropped jobs are abandoned rather than left waiting.
+TEST(OrderedThreadPoolTest, ShutdownAbortFutures) {
+  for (bool reorder_buffer : {false, true}) {
+    OrderedThreadPool<int> thread_pool{
+        2, {.max_pending_jobs = 0, .reorder_buffer = reorder_buffer}};
+    std::atomic<bool> started{false};
+    PoolFuture<int> running = thread_pool.DoAsync(
+        [&started, token = thread_pool.cancellation_token()] {
+          started = true;
+          while (!token.cancelled()) std::this_thread::yield();
+          return 0;
+        });
+    while (!started) std::this_thread::yield();
+    // May finish ahead of the first, and is then parked or waits its turn.
+    PoolFuture<int> finished = thread_pool.DoAsync([] { return 1; });
+    std::vector<PoolFuture<int>> queued;
+    for (int i = 0; i < 10; ++i) {
+      queued.push_back(thread_pool.DoAsync([i] { return i; }));
+    }
+    thread_pool.Shutdown(ShutdownMode::kAbort);
+    running.Wait();
+    ASSERT_TRUE(running.Abandoned());
+    finished.Wait();
+    ASSERT_TRUE(finished.Abandoned());
+    for (PoolFuture<int>& future : queued) {
+      future.Wait();
+      ASSERT_TRUE(future.Abandoned());
+      ASSERT_THROW(future.Get(), std::future_error);
+    }
+  }
+}
+
+// Producers waiting for the window or for cost to be released, and
+// WaitIdle(), return on abort.
+TEST(OrderedThreadPoolTest, ShutdownAbortWakesProducers) {
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 0, .max_in_flight = 1},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .max_pending_cost = 1}}) {
+    OrderedThreadPool<int> thread_pool{1, options};
+    std::atomic<bool> started{false};
+    thread_pool.Do(
+        [&started, token = thread_pool.cancellation_token()] {
+          started = true;
+          while (!token.cancelled()) std::this_thread::yield();
+          return 0;
+        },
+        [](int) {}, 1);
+    while (!started) std::this_thread::yield();
+    PoolFuture<int> blocked;
+    std::thread producer([&thread_pool, &blocked] {
+      blocked = thread_pool.DoAsync([] { return 1; });
+    });
+    std::thread waiter([&thread_pool] { thread_pool.WaitIdle(); });
+    thread_pool.Shutdown(ShutdownMode::kAbort);
+    producer.join();
+    waiter.join();
+    ASSERT_FALSE(thread_pool.WaitIdleFor(std::chrono::milliseconds(1)));
+    blocked.Wait();
+    ASSERT_TRUE(blocked.Abandoned());
+  }
+}
+
+TEST(OrderedThreadPoolTest, ShutdownDrain) {
+  std::vector<int> delivered;
+  OrderedThreadPool<int> thread_pool{4, 0};
+  for (int i = 0; i < 50; ++i) {
+    thread_pool.Do([i] { return i; },
+                   [&delivered](int k) { delivered.push_back(k); });
+  }
+  thread_pool.Shutdown();
+  ASSERT_FALSE(thread_pool.cancellation_token().cancelled());
+  ASSERT_EQ(delivered.size(), 50);
+  // Called again by the destructor.
+  thread_pool.Shutdown();
+}
+
+TEST(OrderedThreadPoolTest, Stats) {
+  OrderedThreadPool<int> thread_pool{2, 4};
+  for (int i = 0; i < 30; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+    thread_pool.Do(i, [i] { return i; }, [](int) {});
+  }
+  thread_pool.WaitIdle();
+  OrderedThreadPoolStats stats = thread_pool.Stats();
+  ASSERT_EQ(stats.jobs_submitted, 60);
+  ASSERT_EQ(stats.jobs_delivered, 60);
+  ASSERT_EQ(stats.in_flight, 0);
+  ASSERT_EQ(stats.queue_depth, 0);
+  ASSERT_EQ(stats.max_pending_jobs, 4);
+  ASSERT_EQ(stats.num_workers, 2);
+  // Not collected by default.
+  ASSERT_EQ(stats.jobs_started, 0);
+  ASSERT_EQ(stats.worker_busy_time.count(), 0);
+}
+
+TEST(OrderedThreadPoolTest, StatsInFlight) {
+  std::atomic<bool> release{false};
+  OrderedThreadPool<int> thread_pool{1, 0};
+  thread_pool.Do(
+      [&release] {
+        while (!release) std::this_thread::yield();
+        return 0;
+      },
+      [](int) {});
+  for (int i = 0; i < 5; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+  }
+  OrderedThreadPoolStats stats = thread_pool.Stats();
+  ASSERT_EQ(stats.in_flight, 6);
+  // The first job may not have been taken yet.
+  ASSERT_GE(stats.queue_depth, 5);
+  ASSERT_LE(stats.queue_depth, 6);
+  release = true;
+  thread_pool.WaitIdle();
+  ASSERT_EQ(thread_pool.Stats().in_flight, 0);
+}
+
+TEST(OrderedThreadPoolTest, CollectStats) {
+  using std::chrono::milliseconds;
+  OrderedThreadPool<int> thread_pool{
+      2, {.max_pending_jobs = 1, .collect_stats = true}};
+  // Both workers idle till the first jobs.
+  std::this_thread::sleep_for(milliseconds(20));
+  // The second job waits for the ticket of the first. Later jobs block the
+  // producer while the queue is full.
+  thread_pool.Do(
+      [] {
+        std::this_thread::sleep_for(milliseconds(50));
+        return 0;
+      },
+      [](int) {});
+  for (int i = 0; i < 4; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+  }
+  thread_pool.WaitIdle();
+  OrderedThreadPoolStats stats = thread_pool.Stats();
+  ASSERT_EQ(stats.jobs_started, 5);
+  ASSERT_EQ(stats.jobs_completed, 5);
+  ASSERT_EQ(stats.jobs_delivered, 5);
+  ASSERT_GE(stats.worker_idle_time, milliseconds(20));
+  ASSERT_GE(stats.worker_busy_time, milliseconds(50));
+  ASSERT_GE(stats.ticket_wait_time, milliseconds(10));
+  ASSERT_GE(stats.producer_blocked_time, milliseconds(10));
+}
+
+TEST(OrderedThreadPoolTest, Latencies) {
+  using std::chrono::milliseconds;
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 4,
+                                 .collect_latency = true},
+        OrderedThreadPoolOptions{.max_pending_jobs = 4,
+                                 .reorder_buffer = true,
+                                 .collect_latency = true}}) {
+    OrderedThreadPool<int> thread_pool{2, options};
+    // The second job finishes first, and waits for the first.
+    thread_pool.Do(
+        [] {
+          std::this_thread::sleep_for(milliseconds(30));
+          return 0;
+        },
+        [](int) { std::this_thread::sleep_for(milliseconds(2)); });
+    for (int i = 1; i < 10; ++i) {
+      thread_pool.Do([i] { return i; }, [](int) {});
+    }
+    thread_pool.WaitIdle();
+    OrderedThreadPoolLatencies latencies = thread_pool.Latencies();
+    ASSERT_EQ(latencies.queue.count(), 10);
+    ASSERT_EQ(latencies.run.count(), 10);
+    ASSERT_EQ(latencies.reorder.count(), 10);
+    ASSERT_EQ(latencies.completion.count(), 10);
+    ASSERT_GE(latencies.run.Max(), milliseconds(30));
+    ASSERT_GE(latencies.reorder.Max(), milliseconds(10));
+    ASSERT_GE(latencies.completion.Max(), milliseconds(2));
+    // Kept after the workers exit.
+    thread_pool.Resize(1);
+    thread_pool.Shutdown();
+    ASSERT_EQ(thread_pool.Latencies().run.count(), 10);
+  }
+}
+
+TEST(OrderedThreadPoolTest, LatenciesNotCollected) {
+  OrderedThreadPool<int> thread_pool{2};
+  thread_pool.Do([] { return 0; }, [](int) {});
+  thread_pool.WaitIdle();
+  ASSERT_EQ(thread_pool.Latencies().run.count(), 0);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Chunked parallel loops running on an OrderedThreadPool.
+//
+// Instead of one job per element, the range is split into chunks of grain
+// elements, and each chunk is one job. Unless a grain is given, it is chosen
+// from the time per element observed so far, so that each chunk takes about
+// GrainSizer::kTargetChunkTime.
+//
+// Example -
+//
+//   OrderedThreadPool<int> pool{10, 4};
+//   ParallelFor(pool, items.size(), [&](size_t i) { Process(items[i]); });
+//   OrderedTransform(pool, in.begin(), in.end(), std::back_inserter(out),
+//                    CostlyFn);
+//
+// Both block till the whole range is done, so they must not be called from a
+// job running on the same pool. The jobs return a default-constructed
+// ReturnType of the pool, which is ignored.
+//
+#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ordered_thread_pool.h"
+
+// Picks the number of elements per chunk.
+class GrainSizer {
+ public:
+  // Chunks are sized to take about this long once the time per element is
+  // known.
+  static constexpr std::chrono::nanoseconds kTargetChunkTime =
+      std::chrono::microseconds(200);
+  // Each worker should get at least this many chunks, so that uneven chunks
+  // can still be balanced.
+  static constexpr size_t kMinChunksPerWorker = 4;
+
+  /**
+   * @param num_elements Size of the whole range.
+   * @param num_workers Workers of the pool.
+   * @param grain Fixed number of elements per chunk. A value of 0 picks it
+   *   adaptively.
+   **/
+  GrainSizer(size_t num_elements, int num_workers, size_t grain)
+      : grain_(grain),
+        max_grain_(std::max<size_t>(
+            1, num_elements / (kMinChunksPerWorker *
+                               std::max<size_t>(1, num_workers)))) {}
+
+  // Size of the next chunk to submit.
+  size_t Next() {
+    if (grain_ > 0) {
+      return grain_;
+    }
+    uint64_t measured = measured_elements_.load(std::memory_order_relaxed);
+    if (measured == 0) {
+      // Nothing has finished yet. Grow the probe chunks geometrically, so that
+      // a slow first chunk does not leave the rest of the range in tiny jobs.
+      size_t probe = probe_;
+      probe_ = std::min(probe_ * 2, max_grain_);
+      return std::min(probe, max_grain_);
+    }
+    uint64_t ns_per_element = std::max<uint64_t>(
+        1, measured_ns_.load(std::memory_order_relaxed) / measured);
+    return std::clamp<size_t>(kTargetChunkTime.count() / ns_per_element, 1,
+                              max_grain_);
+  }
+
+  // Called from the jobs with the time taken by a chunk.
+  void Record(size_t num_elements, std::chrono::nanoseconds elapsed) {
+    measured_ns_.fetch_add(elapsed.count(), std::memory_order_relaxed);
+    measured_elements_.fetch_add(num_elements, std::memory_order_relaxed);
+  }
+
+ private:
+  const size_t grain_;
+  const size_t max_grain_;
+  size_t probe_ = 1;
+  std::atomic<uint64_t> measured_ns_{0};
+  std::atomic<uint64_t> measured_elements_{0};
+};
+
+namespace parallel_for_internal {
+
+// Lets the caller wait till the completion of the last chunk.
+class Done {
+ public:
+  void Notify() {
+    // Notify holding the lock, since the waiter destroys this on waking up.
+    std::lock_guard<std::mutex> lck(mtx_);
+    done_ = true;
+    cv_.notify_one();
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lck(mtx_);
+    cv_.wait(lck, [this] { return done_; });
+  }
+
+ private:
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool done_ = false;
+};
+
+// Submits chunks covering [0, n) to pool. run_chunk(begin, end) does the work
+// and returns the output of the chunk, which is passed on to the completion
+// deliver_chunk(output). Blocks till the last completion.
+template <class ReturnType, class RunChunkFn, class DeliverChunkFn>
+void RunChunked(OrderedThreadPool<ReturnType>& pool, size_t n, size_t grain,
+                RunChunkFn run_chunk, DeliverChunkFn deliver_chunk) {
+  using Output = decltype(run_chunk(size_t(), size_t()));
+  if (n == 0) {
+    return;
+  }
+  GrainSizer sizer{n, pool.num_workers(), grain};
+  Done done;
+  for (size_t begin = 0; begin < n;) {
+    size_t end = begin + std::min(sizer.Next(), n - begin);
+    // Owned by the completion, which always outlives the job.
+    auto output = std::make_unique<std::optional<Output>>();
+    std::optional<Output>* output_ptr = output.get();
+    pool.Do(
+        [&sizer, &run_chunk, begin, end, output_ptr] {
+          auto start = std::chrono::steady_clock::now();
+          output_ptr->emplace(run_chunk(begin, end));
+          sizer.Record(end - begin, std::chrono::steady_clock::now() - start);
+          return ReturnType();
+        },
+        [&done, &deliver_chunk, last = end == n,
+         output = std::move(output)](ReturnType) {
+          deliver_chunk(std::move(**output));
+          if (last) {
+            done.Notify();
+          }
+        });
+    begin = end;
+  }
+  done.Wait();
+}
+
+}  // namespace parallel_for_internal
+
+/**
+ * Calls fn(i) for every i in [0, n), in parallel, and blocks till all calls
+ * have returned.
+ *
+ * @param pool The pool to run on.
+ * @param n Number of indices.
+ * @param fn Called once with each index, from any worker.
+ * @param grain Number of indices per job. A value of 0 picks it adaptively.
+ **/
+template <class ReturnType, class Fn>
+void ParallelFor(OrderedThreadPool<ReturnType>& pool, size_t n, Fn fn,
+                 size_t grain = 0) {
+  struct NoOutput {};
+  parallel_for_internal::RunChunked(
+      pool, n, grain,
+      [&fn](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          fn(i);
+        }
+        return NoOutput();
+      },
+      [](NoOutput) {});
+}
+
+/**
+ * Like std::transform(first, last, out, fn), with fn called in parallel.
+ *
+ * The results are written to out in the order of the input, as each chunk
+ * and all chunks before it are done. Blocks till the whole range is written.
+ *
+ * @param pool The pool to run on.
+ * @param grain Number of elements per job. A value of 0 picks it adaptively.
+ * @return The output iterator past the last element written.
+ **/
+template <class ReturnType, class RandomIt, class OutputIt, class Fn>
+OutputIt OrderedTransform(OrderedThreadPool<ReturnType>& pool, RandomIt first,
+                          RandomIt last, OutputIt out, Fn fn,
+                          size_t grain = 0) {
+  using Result = std::decay_t<decltype(fn(*first))>;
+  parallel_for_internal::RunChunked(
+      pool, last - first, grain,
+      [&fn, first](size_t begin, size_t end) {
+        std::vector<Result> results;
+        results.reserve(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+          results.push_back(fn(first[i]));
+        }
+        return results;
+      },
+      [&out](std::vector<Result> results) {
+        for (Result& result : results) {
+          *out++ = std::move(result);
+        }
+      });
+  return out;
+}
+
+#endif  // PARALLEL_FOR_H
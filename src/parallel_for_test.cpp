@@ -0,0 +1,108 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "parallel_for.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <string>
+#include <vector>
+
+TEST(ParallelForTest, VisitsEachIndexOnce) {
+  OrderedThreadPool<int> pool{4, 2};
+  for (size_t grain : {0, 1, 7, 5000}) {
+    std::vector<std::atomic<int>> visit_count(1000);
+    ParallelFor(pool, visit_count.size(), [&](size_t i) { ++visit_count[i]; },
+                grain);
+    for (const std::atomic<int>& count : visit_count) {
+      ASSERT_EQ(count, 1);
+    }
+  }
+}
+
+TEST(ParallelForTest, Unthreaded) {
+  OrderedThreadPool<int> pool{0};
+  std::vector<size_t> visited;
+  ParallelFor(pool, 5, [&](size_t i) { visited.push_back(i); });
+  ASSERT_EQ(visited, (std::vector<size_t>{0, 1, 2, 3, 4}));
+}
+
+TEST(ParallelForTest, Empty) {
+  OrderedThreadPool<int> pool{4};
+  ParallelFor(pool, 0, [](size_t) { FAIL(); });
+}
+
+TEST(OrderedTransformTest, WritesInOrder) {
+  std::vector<int> input(10000);
+  for (int i = 0; i < (int)input.size(); ++i) input[i] = i;
+  for (const OrderedThreadPoolOptions& options :
+       {OrderedThreadPoolOptions{.max_pending_jobs = 2},
+        OrderedThreadPoolOptions{.max_pending_jobs = 0,
+                                 .reorder_buffer = true}}) {
+    OrderedThreadPool<int> pool{4, options};
+    std::vector<std::string> output;
+    OrderedTransform(pool, input.begin(), input.end(),
+                     std::back_inserter(output),
+                     [](int k) { return std::to_string(k); });
+    ASSERT_EQ(output.size(), input.size());
+    for (int i = 0; i < (int)input.size(); ++i) {
+      ASSERT_EQ(output[i], std::to_string(i));
+    }
+  }
+}
+
+TEST(OrderedTransformTest, ReturnsEndOfOutput) {
+  OrderedThreadPool<int> pool{3};
+  std::vector<int> input{1, 2, 3, 4, 5};
+  std::vector<int> output(7, 0);
+  auto end = OrderedTransform(pool, input.begin(), input.end(),
+                              output.begin(), [](int k) { return k * k; }, 2);
+  ASSERT_EQ(end, output.begin() + 5);
+  ASSERT_EQ(output, (std::vector<int>{1, 4, 9, 16, 25, 0, 0}));
+}
+
+TEST(GrainSizerTest, FixedGrain) {
+  GrainSizer sizer{1000, 4, 10};
+  ASSERT_EQ(sizer.Next(), 10);
+  sizer.Record(10, std::chrono::seconds(1));
+  ASSERT_EQ(sizer.Next(), 10);
+}
+
+TEST(GrainSizerTest, AdaptsToTimePerElement) {
+  GrainSizer sizer{1000000, 4, 0};
+  // Probes grow till a measurement is available.
+  ASSERT_EQ(sizer.Next(), 1);
+  ASSERT_EQ(sizer.Next(), 2);
+  ASSERT_EQ(sizer.Next(), 4);
+  sizer.Record(100, std::chrono::microseconds(100));
+  ASSERT_EQ(sizer.Next(), GrainSizer::kTargetChunkTime /
+                              std::chrono::microseconds(1));
+  // Slow elements get a chunk each.
+  sizer.Record(1, std::chrono::seconds(1));
+  ASSERT_EQ(sizer.Next(), 1);
+}
+
+TEST(GrainSizerTest, LeavesChunksForEveryWorker) {
+  GrainSizer sizer{100, 5, 0};
+  sizer.Record(1000, std::chrono::nanoseconds(1));
+  ASSERT_EQ(sizer.Next(), 100 / (5 * GrainSizer::kMinChunksPerWorker));
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,341 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A pipeline of stages, each of which is either parallel or serial.
+//
+// OrderedThreadPool has two stages: a parallel job_fn and a serial
+// completion_fn. A Pipeline generalizes this to any sequence of stages -
+//
+//   auto pipeline = MakePipeline<std::string>(
+//       /*num_workers=*/10, /*max_in_flight=*/64,
+//       Parallel(Parse), Parallel(Enrich), Serial(Dedupe), Parallel(Encode),
+//       Serial(Write));
+//   while (...) {
+//     pipeline->Push(line);
+//   }
+//
+// Properties -
+// - Each stage is called with the output of the previous one.
+// - A parallel stage may run for several items at once.
+// - A serial stage runs for one item at a time, in the order of Push().
+// - Items move between stages on the workers. A parallel stage following a
+//   parallel stage runs right away on the same worker.
+// - At most max_in_flight items are in the pipeline. Push() blocks till an
+//   item leaves the last stage. This bounds the items waiting between stages.
+// - On destruction blocks till all items are through.
+//
+// A serial stage reuses the ticket scheme of OrderedThreadPool's reorder
+// buffer: an item arriving ahead of its turn is parked, and the thread which
+// runs the stage for the item in turn also runs it for the parked items which
+// follow.
+//
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "job_queue.h"
+#include "move_only_function.h"
+
+template <class Fn>
+struct ParallelStage {
+  Fn fn;
+};
+
+template <class Fn>
+struct SerialStage {
+  Fn fn;
+};
+
+// A stage which may run for several items at once.
+template <class Fn>
+ParallelStage<Fn> Parallel(Fn fn) {
+  return {std::move(fn)};
+}
+
+// A stage which runs for one item at a time, in order.
+template <class Fn>
+SerialStage<Fn> Serial(Fn fn) {
+  return {std::move(fn)};
+}
+
+namespace pipeline_internal {
+
+template <class Stage>
+struct IsSerial : std::false_type {};
+template <class Fn>
+struct IsSerial<SerialStage<Fn>> : std::true_type {};
+
+// The output of stage when called with In. void becomes std::monostate, so
+// that it can be passed around.
+template <class Stage, class In>
+using OutputOf = std::conditional_t<
+    std::is_void_v<std::invoke_result_t<decltype(Stage::fn)&, In>>,
+    std::monostate, std::invoke_result_t<decltype(Stage::fn)&, In>>;
+
+// A std::tuple of the input types of each of Stages, the first being In.
+template <class In, class... Stages>
+struct InputTypes {
+  using type = std::tuple<>;
+};
+template <class In, class Stage, class... Rest>
+struct InputTypes<In, Stage, Rest...> {
+  using type = decltype(std::tuple_cat(
+      std::tuple<In>(),
+      typename InputTypes<OutputOf<Stage, In>, Rest...>::type()));
+};
+
+// Bookkeeping of a stage. Parallel stages need none.
+template <class Stage, class In>
+struct StageState {
+  explicit StageState(size_t) {}
+};
+
+template <class Fn, class In>
+struct StageState<SerialStage<Fn>, In> {
+  explicit StageState(size_t ring_size) : parked(ring_size) {}
+
+  std::mutex mtx;
+  // Sequence number of the next item to go through the stage.
+  size_t next = 0;
+  // Set while a thread runs the stage for consecutive items.
+  bool draining = false;
+  // Items which arrived ahead of their turn, indexed by sequence number modulo
+  // the size, a power of two no smaller than max_in_flight.
+  std::vector<std::optional<In>> parked;
+};
+
+}  // namespace pipeline_internal
+
+template <class Input, class... Stages>
+class Pipeline {
+  static constexpr size_t kNumStages = sizeof...(Stages);
+  using Inputs =
+      typename pipeline_internal::InputTypes<Input, Stages...>::type;
+  template <size_t K>
+  using StageAt = std::tuple_element_t<K, std::tuple<Stages...>>;
+  template <size_t K>
+  using InputAt = std::tuple_element_t<K, Inputs>;
+  template <size_t K>
+  using OutputAt = pipeline_internal::OutputOf<StageAt<K>, InputAt<K>>;
+
+ public:
+  /**
+   * Instantiates a pipeline. MakePipeline() deduces the template arguments.
+   *
+   * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+   *   threads, and use the calling thread to perform the work.
+   * @param max_in_flight Most items in the pipeline at once. Must be positive.
+   * @param stages Made with Parallel() or Serial().
+   **/
+  Pipeline(int num_workers, int max_in_flight, Stages... stages)
+      : stages_(std::move(stages)...),
+        ring_size_(RingSize(max_in_flight)),
+        states_(MakeStates(std::index_sequence_for<Stages...>())),
+        fn_queue_(0, false),
+        max_in_flight_(max_in_flight) {
+    static_assert(kNumStages > 0, "A pipeline needs at least one stage.");
+    for (int i = 0; i < num_workers; ++i) {
+      workers_.push_back(std::thread(&Pipeline::Worker, this, i));
+    }
+  }
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  /**
+   * Feeds an item to the first stage. Blocks while max_in_flight items are in
+   * the pipeline.
+   **/
+  void Push(Input input) {
+    size_t seq;
+    {
+      std::unique_lock<std::mutex> lck(in_flight_mtx_);
+      in_flight_update_.wait(lck,
+                             [this] { return in_flight_ < max_in_flight_; });
+      ++in_flight_;
+      seq = next_seq_++;
+    }
+    Submit([this, seq, input = std::move(input)]() mutable {
+      Process<0>(seq, std::move(input));
+    });
+  }
+
+  virtual ~Pipeline() {
+    // Items may still create work for the workers till they are through.
+    {
+      std::unique_lock<std::mutex> lck(in_flight_mtx_);
+      in_flight_update_.wait(lck, [this] { return in_flight_ == 0; });
+    }
+    fn_queue_.Close();
+    for (std::thread& t : workers_) {
+      t.join();
+    }
+  }
+
+ private:
+  static size_t RingSize(int max_in_flight) {
+    size_t size = 1;
+    while (size < (size_t)max_in_flight) size *= 2;
+    return size;
+  }
+
+  // The tuple of the StageState of each stage.
+  template <size_t... K>
+  static auto StatesType(std::index_sequence<K...>)
+      -> std::tuple<pipeline_internal::StageState<StageAt<K>, InputAt<K>>...>;
+  using States = decltype(StatesType(std::index_sequence_for<Stages...>()));
+
+  template <size_t... K>
+  States MakeStates(std::index_sequence<K...>) {
+    return States(((void)K, ring_size_)...);
+  }
+
+  void Worker(int worker_index) {
+    while (std::optional<MoveOnlyFunction<void()>> fn =
+               fn_queue_.Pop(worker_index)) {
+      (*fn)();
+    }
+  }
+
+  void Submit(MoveOnlyFunction<void()> fn) {
+    if (workers_.empty()) {
+      fn();
+      return;
+    }
+    fn_queue_.Push([&fn] { return std::move(fn); });
+  }
+
+  // Calls stage K with value.
+  template <size_t K>
+  OutputAt<K> Run(InputAt<K> value) {
+    auto& fn = std::get<K>(stages_).fn;
+    if constexpr (std::is_same_v<OutputAt<K>, std::monostate>) {
+      static_assert(K + 1 == kNumStages,
+                    "Only the last stage may return void.");
+      fn(std::move(value));
+      return {};
+    } else {
+      return fn(std::move(value));
+    }
+  }
+
+  // Passes the item with sequence number seq through stage K.
+  template <size_t K>
+  void Process(size_t seq, InputAt<K> value) {
+    if constexpr (pipeline_internal::IsSerial<StageAt<K>>::value) {
+      Offer<K>(seq, std::move(value));
+    } else {
+      Forward<K>(seq, Run<K>(std::move(value)), /*from_serial=*/false);
+    }
+  }
+
+  // Runs the serial stage K for the item, if it is its turn, and then for the
+  // consecutive parked items. Otherwise parks the item.
+  template <size_t K>
+  void Offer(size_t seq, InputAt<K> value) {
+    auto& state = std::get<K>(states_);
+    std::unique_lock<std::mutex> lck(state.mtx);
+    if (state.draining || seq != state.next) {
+      state.parked[seq & (ring_size_ - 1)] = std::move(value);
+      return;
+    }
+    state.draining = true;
+    std::optional<InputAt<K>> next{std::move(value)};
+    while (true) {
+      // Run outside the lock, so that other workers can park meanwhile. The
+      // draining flag keeps the stage serialized.
+      lck.unlock();
+      Forward<K>(seq, Run<K>(std::move(*next)), /*from_serial=*/true);
+      lck.lock();
+      seq = ++state.next;
+      std::optional<InputAt<K>>& slot = state.parked[seq & (ring_size_ - 1)];
+      if (!slot.has_value()) break;
+      next = std::move(slot);
+      slot.reset();
+    }
+    state.draining = false;
+  }
+
+  // Hands the output of stage K to the next stage.
+  template <size_t K>
+  void Forward(size_t seq, OutputAt<K> value, bool from_serial) {
+    if constexpr (K + 1 == kNumStages) {
+      Finish();
+    } else if constexpr (pipeline_internal::IsSerial<StageAt<K + 1>>::value) {
+      Offer<K + 1>(seq, std::move(value));
+    } else if (from_serial) {
+      // Do not hold up the serial stage with parallel work.
+      Submit([this, seq, value = std::move(value)]() mutable {
+        Process<K + 1>(seq, std::move(value));
+      });
+    } else {
+      Process<K + 1>(seq, std::move(value));
+    }
+  }
+
+  // Called when an item leaves the last stage.
+  void Finish() {
+    std::lock_guard<std::mutex> lck(in_flight_mtx_);
+    --in_flight_;
+    in_flight_update_.notify_all();
+  }
+
+  std::tuple<Stages...> stages_;
+  const size_t ring_size_;
+  States states_;
+
+  // The worker threads are initialized on construction and maintained.
+  std::vector<std::thread> workers_;
+  // Stages waiting for a worker.
+  JobQueue<MoveOnlyFunction<void()>> fn_queue_;
+
+  // Guards in_flight_ and next_seq_.
+  std::mutex in_flight_mtx_;
+  std::condition_variable in_flight_update_;
+  // Items pushed and not yet through the last stage, and their limit.
+  int in_flight_ = 0;
+  const int max_in_flight_;
+  // Sequence number of the next item pushed.
+  size_t next_seq_ = 0;
+};
+
+/**
+ * Instantiates a Pipeline taking items of type Input.
+ *
+ * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+ *   threads, and use the calling thread to perform the work.
+ * @param max_in_flight Most items in the pipeline at once. Must be positive.
+ * @param stages Made with Parallel() or Serial().
+ **/
+template <class Input, class... Stages>
+std::unique_ptr<Pipeline<Input, Stages...>> MakePipeline(int num_workers,
+                                                         int max_in_flight,
+                                                         Stages... stages) {
+  return std::make_unique<Pipeline<Input, Stages...>>(
+      num_workers, max_in_flight, std::move(stages)...);
+}
+
+#endif  // PIPELINE_H
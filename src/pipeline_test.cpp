@@ -0,0 +1,142 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pipeline.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sleeps longer for items which are multiples of 7, so that items overtake
+// each other in the parallel stages.
+void Jitter(int k) {
+  if (k % 7 == 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+}
+
+TEST(PipelineTest, FiveStages) {
+  std::vector<int> deduped;
+  std::vector<std::string> written;
+  {
+    auto pipeline = MakePipeline<int>(
+        8, 16,
+        Parallel([](int k) {
+          Jitter(k);
+          return k * 2;
+        }),
+        Parallel([](int k) { return k + 1; }),
+        Serial([&deduped](int k) {
+          deduped.push_back(k);
+          return k;
+        }),
+        Parallel([](int k) {
+          Jitter(k);
+          return std::to_string(k);
+        }),
+        Serial([&written](std::string s) { written.push_back(s); }));
+    for (int i = 0; i < 500; ++i) {
+      pipeline->Push(i);
+    }
+  }
+  ASSERT_EQ(deduped.size(), 500);
+  ASSERT_EQ(written.size(), 500);
+  for (int i = 0; i < 500; ++i) {
+    ASSERT_EQ(deduped[i], i * 2 + 1);
+    ASSERT_EQ(written[i], std::to_string(i * 2 + 1));
+  }
+}
+
+TEST(PipelineTest, Unthreaded) {
+  std::vector<int> delivered;
+  auto pipeline = MakePipeline<int>(
+      0, 1, Parallel([](int k) { return k * k; }),
+      Serial([&delivered](int k) { delivered.push_back(k); }));
+  for (int i = 0; i < 5; ++i) {
+    pipeline->Push(i);
+  }
+  ASSERT_EQ(delivered, (std::vector<int>{0, 1, 4, 9, 16}));
+}
+
+// Consecutive serial stages, and a serial first stage.
+TEST(PipelineTest, SerialOnly) {
+  std::vector<int> delivered;
+  {
+    auto pipeline = MakePipeline<int>(
+        4, 4, Serial([](int k) { return k + 1; }),
+        Serial([](int k) { return k * 10; }),
+        Serial([&delivered](int k) { delivered.push_back(k); }));
+    for (int i = 0; i < 100; ++i) {
+      pipeline->Push(i);
+    }
+  }
+  ASSERT_EQ(delivered.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(delivered[i], (i + 1) * 10);
+  }
+}
+
+TEST(PipelineTest, BoundsItemsInFlight) {
+  std::atomic<int> in_flight{0};
+  std::atomic<int> max_in_flight{0};
+  {
+    auto pipeline = MakePipeline<int>(
+        8, 5,
+        Parallel([&](int k) {
+          int now = ++in_flight;
+          int max = max_in_flight;
+          while (now > max && !max_in_flight.compare_exchange_weak(max, now)) {
+          }
+          Jitter(k);
+          return k;
+        }),
+        Serial([&](int) { --in_flight; }));
+    for (int i = 0; i < 200; ++i) {
+      pipeline->Push(i);
+    }
+  }
+  ASSERT_LE(max_in_flight, 5);
+}
+
+TEST(PipelineTest, MoveOnlyItems) {
+  std::vector<int> delivered;
+  {
+    auto pipeline = MakePipeline<std::unique_ptr<int>>(
+        4, 8,
+        Parallel([](std::unique_ptr<int> k) {
+          *k += 1;
+          return k;
+        }),
+        Serial([&delivered](std::unique_ptr<int> k) {
+          delivered.push_back(*k);
+        }));
+    for (int i = 0; i < 50; ++i) {
+      pipeline->Push(std::make_unique<int>(i));
+    }
+  }
+  ASSERT_EQ(delivered.size(), 50);
+  for (int i = 0; i < 50; ++i) {
+    ASSERT_EQ(delivered[i], i + 1);
+  }
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A future for the result of a job, as returned by DoAsync().
+//
+// Unlike std::future with std::packaged_task, the shared state is not
+// allocated per job. Released states are cached per thread and reused, so in
+// steady state DoAsync() does not allocate beyond what Do() does.
+//
+// Example -
+//
+//   PoolFuture<int> a = pool.DoAsync(CostlyFn);
+//   PoolFuture<std::string> b =
+//       std::move(a).Then([](int k) { return std::to_string(k); });
+//   std::string result = b.Get();
+//
+// Then() does not block. Its continuation runs on the thread that provides
+// the value, which is a worker of the pool, or right away on the calling
+// thread if the value is already there. The pools provide the value outside
+// their locks, so the continuation may submit dependent jobs to the pool.
+//
+// If the promise is destroyed without a value, e.g. since the pool dropped the
+// job, the future becomes ready and Abandoned(). Get() then throws
+// std::future_error with std::future_errc::broken_promise, as std::future
+// does, and continuations are not called. Their futures are abandoned in turn.
+//
+#ifndef POOL_FUTURE_H
+#define POOL_FUTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "move_only_function.h"
+
+namespace pool_future_internal {
+
+// What a future of T holds. Futures of void hold an empty value.
+template <class T>
+using Stored = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+// Calls fn with value, or without arguments if value is empty. Returns the
+// result as Stored.
+template <class T, class Fn>
+auto Invoke(Fn& fn, Stored<T>&& value) {
+  if constexpr (std::is_void_v<T>) {
+    using U = std::invoke_result_t<Fn&>;
+    if constexpr (std::is_void_v<U>) {
+      fn();
+      return std::monostate();
+    } else {
+      return fn();
+    }
+  } else {
+    using U = std::invoke_result_t<Fn&, T>;
+    if constexpr (std::is_void_v<U>) {
+      fn(std::move(value));
+      return std::monostate();
+    } else {
+      return fn(std::move(value));
+    }
+  }
+}
+
+// The state shared by a PoolPromise and its PoolFuture. Reference counted,
+// and recycled through a per-thread cache once both are gone.
+template <class T>
+class State {
+ public:
+  // Most states kept for reuse per thread.
+  static constexpr size_t kMaxCached = 64;
+
+  // Returns a state with a single reference.
+  static State* Acquire() {
+    std::vector<State*>& cache = Cache().states;
+    State* state;
+    if (cache.empty()) {
+      state = new State();
+    } else {
+      state = cache.back();
+      cache.pop_back();
+    }
+    state->refs_.store(1, std::memory_order_relaxed);
+    return state;
+  }
+
+  void AddRef() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+  void Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    value_.reset();
+    continuation_ = nullptr;
+    abandoned_ = false;
+    ready_.store(false, std::memory_order_relaxed);
+    std::vector<State*>& cache = Cache().states;
+    if (cache.size() < kMaxCached) {
+      cache.push_back(this);
+    } else {
+      delete this;
+    }
+  }
+
+  // Stores the value, or passes it to the continuation if there is one.
+  void Set(Stored<T> value) {
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (continuation_) {
+      MoveOnlyFunction<void(Stored<T>)> continuation =
+          std::move(continuation_);
+      lck.unlock();
+      continuation(std::move(value));
+      return;
+    }
+    value_ = std::move(value);
+    ready_.store(true, std::memory_order_release);
+    if (num_waiting_ > 0) {
+      ready_cv_.notify_all();
+    }
+  }
+
+  // Called if the promise is destroyed without a value. Drops the
+  // continuation, which abandons its own promise.
+  void Abandon() {
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (continuation_) {
+      MoveOnlyFunction<void(Stored<T>)> continuation =
+          std::move(continuation_);
+      lck.unlock();
+      return;
+    }
+    abandoned_ = true;
+    ready_.store(true, std::memory_order_release);
+    if (num_waiting_ > 0) {
+      ready_cv_.notify_all();
+    }
+  }
+
+  bool Ready() const { return ready_.load(std::memory_order_acquire); }
+
+  // Only valid once Ready().
+  bool Abandoned() const { return abandoned_; }
+
+  void Wait() {
+    if (Ready()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lck(mtx_);
+    ++num_waiting_;
+    ready_cv_.wait(lck, [this] { return Ready(); });
+    --num_waiting_;
+  }
+
+  Stored<T> Take() {
+    Wait();
+    return std::move(*value_);
+  }
+
+  // Arranges for continuation to be called with the value. Calls it right
+  // away if the value is already there, or drops it if the state was
+  // abandoned.
+  void OnReady(MoveOnlyFunction<void(Stored<T>)> continuation) {
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (!Ready()) {
+      continuation_ = std::move(continuation);
+      return;
+    }
+    lck.unlock();
+    if (!abandoned_) {
+      continuation(std::move(*value_));
+    }
+  }
+
+ private:
+  // Deletes the cached states when the thread exits.
+  struct ThreadCache {
+    std::vector<State*> states;
+    ~ThreadCache() {
+      for (State* state : states) delete state;
+    }
+  };
+
+  static ThreadCache& Cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+
+  std::atomic<int> refs_{0};
+  std::atomic<bool> ready_{false};
+  std::mutex mtx_;
+  std::condition_variable ready_cv_;
+  int num_waiting_ = 0;
+  std::optional<Stored<T>> value_;
+  // Set with ready_ if the promise was destroyed without a value.
+  bool abandoned_ = false;
+  MoveOnlyFunction<void(Stored<T>)> continuation_;
+};
+
+}  // namespace pool_future_internal
+
+template <class T>
+class PoolPromise;
+
+template <class T>
+class PoolFuture {
+  using State = pool_future_internal::State<T>;
+
+ public:
+  // An invalid future. Only assigning to it is allowed.
+  PoolFuture() = default;
+
+  PoolFuture(PoolFuture&& other) noexcept
+      : state_(std::exchange(other.state_, nullptr)) {}
+  PoolFuture& operator=(PoolFuture&& other) noexcept {
+    if (state_ != nullptr) state_->Release();
+    state_ = std::exchange(other.state_, nullptr);
+    return *this;
+  }
+
+  ~PoolFuture() {
+    if (state_ != nullptr) state_->Release();
+  }
+
+  // False once Get() or Then() was called.
+  bool Valid() const { return state_ != nullptr; }
+
+  // True if Get() would not block.
+  bool Ready() const { return state_->Ready(); }
+
+  // True if the promise was destroyed without a value. Only valid once
+  // Ready().
+  bool Abandoned() const { return state_->Abandoned(); }
+
+  // Blocks till the value is available.
+  void Wait() const { state_->Wait(); }
+
+  /**
+   * Blocks till the value is available, and returns it. The future is invalid
+   * afterwards.
+   *
+   * Throws std::future_error with std::future_errc::broken_promise if the
+   * future was abandoned.
+   **/
+  T Get() {
+    State* state = std::exchange(state_, nullptr);
+    state->Wait();
+    if (state->Abandoned()) {
+      state->Release();
+      throw std::future_error(std::future_errc::broken_promise);
+    }
+    if constexpr (std::is_void_v<T>) {
+      state->Release();
+    } else {
+      T value = state->Take();
+      state->Release();
+      return value;
+    }
+  }
+
+  /**
+   * Calls fn with the value once it is available, without blocking. The
+   * future is invalid afterwards.
+   *
+   * @param fn Called with the value, or without arguments for a future of
+   *   void. Runs on the thread which provides the value, usually a worker. If
+   *   the value is already available, runs on the calling thread before Then()
+   *   returns.
+   * @return A future for the result of fn.
+   **/
+  template <class Fn>
+  auto Then(Fn fn) && {
+    using U = decltype(pool_future_internal::Invoke<T>(
+        fn, std::declval<pool_future_internal::Stored<T>>()));
+    using Result = std::conditional_t<std::is_same_v<U, std::monostate>,
+                                      void, U>;
+    PoolPromise<Result> promise;
+    PoolFuture<Result> future = promise.GetFuture();
+    State* state = std::exchange(state_, nullptr);
+    state->OnReady([fn = std::move(fn), promise = std::move(promise)](
+                       pool_future_internal::Stored<T> value) mutable {
+      promise.SetStored(pool_future_internal::Invoke<T>(fn, std::move(value)));
+    });
+    state->Release();
+    return future;
+  }
+
+ private:
+  friend class PoolPromise<T>;
+
+  explicit PoolFuture(State* state) : state_(state) {}
+
+  State* state_ = nullptr;
+};
+
+// The producing side of a PoolFuture. Used by the pools to implement
+// DoAsync().
+template <class T>
+class PoolPromise {
+  using State = pool_future_internal::State<T>;
+
+ public:
+  PoolPromise() : state_(State::Acquire()) {}
+
+  PoolPromise(PoolPromise&& other) noexcept
+      : state_(std::exchange(other.state_, nullptr)) {}
+  PoolPromise& operator=(PoolPromise&&) = delete;
+
+  // Abandons the future if no value was set.
+  ~PoolPromise() {
+    if (state_ != nullptr) {
+      state_->Abandon();
+      state_->Release();
+    }
+  }
+
+  // May be called once.
+  PoolFuture<T> GetFuture() {
+    state_->AddRef();
+    return PoolFuture<T>(state_);
+  }
+
+  // Provides the value. May be called once.
+  template <class... Args>
+  void Set(Args&&... value) {
+    SetStored(pool_future_internal::Stored<T>(std::forward<Args>(value)...));
+  }
+
+  void SetStored(pool_future_internal::Stored<T> value) {
+    State* state = std::exchange(state_, nullptr);
+    state->Set(std::move(value));
+    state->Release();
+  }
+
+ private:
+  State* state_;
+};
+
+#endif  // POOL_FUTURE_H
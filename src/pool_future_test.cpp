@@ -0,0 +1,142 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pool_future.h"
+
+#include <gtest/gtest.h>
+
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+
+TEST(PoolFutureTest, SetThenGet) {
+  PoolPromise<int> promise;
+  PoolFuture<int> future = promise.GetFuture();
+  ASSERT_FALSE(future.Ready());
+  promise.Set(5);
+  ASSERT_TRUE(future.Ready());
+  ASSERT_EQ(future.Get(), 5);
+  ASSERT_FALSE(future.Valid());
+}
+
+TEST(PoolFutureTest, GetWaitsForOtherThread) {
+  PoolPromise<std::string> promise;
+  PoolFuture<std::string> future = promise.GetFuture();
+  std::thread setter{[promise = std::move(promise)]() mutable {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    promise.Set("done");
+  }};
+  ASSERT_EQ(future.Get(), "done");
+  setter.join();
+}
+
+TEST(PoolFutureTest, MoveOnlyValue) {
+  PoolPromise<std::unique_ptr<int>> promise;
+  PoolFuture<std::unique_ptr<int>> future = promise.GetFuture();
+  promise.Set(std::make_unique<int>(3));
+  ASSERT_EQ(*future.Get(), 3);
+}
+
+TEST(PoolFutureTest, ThenBeforeSet) {
+  PoolPromise<int> promise;
+  PoolFuture<std::string> future =
+      promise.GetFuture()
+          .Then([](int k) { return k * 2; })
+          .Then([](int k) { return std::to_string(k); });
+  ASSERT_FALSE(future.Ready());
+  promise.Set(21);
+  ASSERT_EQ(future.Get(), "42");
+}
+
+TEST(PoolFutureTest, ThenAfterSet) {
+  PoolPromise<int> promise;
+  PoolFuture<int> future = promise.GetFuture();
+  promise.Set(1);
+  bool called = false;
+  PoolFuture<void> done = std::move(future).Then([&called](int k) {
+    called = true;
+  });
+  // Ran right away.
+  ASSERT_TRUE(called);
+  ASSERT_TRUE(done.Ready());
+  done.Get();
+}
+
+TEST(PoolFutureTest, Void) {
+  PoolPromise<void> promise;
+  PoolFuture<int> future = promise.GetFuture().Then([] { return 7; });
+  promise.Set();
+  ASSERT_EQ(future.Get(), 7);
+}
+
+// Dropping the future before the value arrives is allowed.
+TEST(PoolFutureTest, Abandoned) {
+  PoolPromise<int> promise;
+  promise.GetFuture();
+  promise.Set(1);
+}
+
+// Destroying the promise without a value makes the future ready, but broken.
+TEST(PoolFutureTest, PromiseDropped) {
+  PoolFuture<int> future;
+  std::thread waiter;
+  {
+    PoolPromise<int> promise;
+    future = promise.GetFuture();
+    waiter = std::thread([&future] { future.Wait(); });
+  }
+  waiter.join();
+  ASSERT_TRUE(future.Ready());
+  ASSERT_TRUE(future.Abandoned());
+  try {
+    future.Get();
+    FAIL();
+  } catch (const std::future_error& e) {
+    ASSERT_EQ(e.code(), std::future_errc::broken_promise);
+  }
+  ASSERT_FALSE(future.Valid());
+}
+
+// Continuations are not called, and their futures are abandoned too, whether
+// they were added before or after the promise was dropped.
+TEST(PoolFutureTest, PromiseDroppedThen) {
+  bool called = false;
+  PoolFuture<int> before;
+  PoolFuture<int> dropped;
+  {
+    PoolPromise<int> promise;
+    before = promise.GetFuture().Then([&called](int k) {
+      called = true;
+      return k;
+    });
+  }
+  {
+    PoolPromise<int> promise;
+    dropped = promise.GetFuture();
+  }
+  PoolFuture<void> after =
+      std::move(dropped).Then([&called](int) { called = true; });
+  ASSERT_FALSE(called);
+  ASSERT_TRUE(before.Ready());
+  ASSERT_TRUE(before.Abandoned());
+  ASSERT_TRUE(after.Ready());
+  ASSERT_TRUE(after.Abandoned());
+  ASSERT_THROW(after.Get(), std::future_error);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
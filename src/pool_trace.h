@@ -0,0 +1,224 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tracing of OrderedThreadPool activity, for viewing in chrome://tracing or
+// https://ui.perfetto.dev.
+//
+// Compiled out unless ORDERED_THREAD_POOL_TRACE is defined. Otherwise
+// Record() is empty, and costs nothing. When enabled, each thread records the
+// events of all pools into a ring buffer of its own, which keeps the last
+// kEventsPerThread events. Buffers outlive their threads, so that the events
+// of exited workers are kept. A buffer is handed on to the next thread which
+// starts recording, so there are only as many buffers as threads which have
+// recorded at the same time, and short-lived workers do not add up.
+//
+// Example -
+//
+//   // Compiled with -DORDERED_THREAD_POOL_TRACE.
+//   {
+//     OrderedThreadPool<int> pool{4};
+//     ...
+//   }
+//   std::ofstream out("trace.json");
+//   pool_trace::WriteChromeTrace(out);
+//
+#ifndef POOL_TRACE_H
+#define POOL_TRACE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace pool_trace {
+
+enum class EventType : uint8_t {
+  // A job was submitted. Recorded by the producer.
+  kEnqueue,
+  // A worker took the job.
+  kDequeue,
+  // job_fn ran.
+  kJobBegin,
+  kJobEnd,
+  // The worker waited for the earlier jobs to be delivered.
+  kTicketWaitBegin,
+  kTicketWaitEnd,
+  // completion_fn ran, or the batch completion starting with the job.
+  kCompletionBegin,
+  kCompletionEnd,
+};
+
+#ifdef ORDERED_THREAD_POOL_TRACE
+
+constexpr bool kEnabled = true;
+
+// Most recent events kept per thread. A power of two.
+constexpr size_t kEventsPerThread = 1 << 14;
+
+struct Event {
+  // Since the first event of the process.
+  std::chrono::nanoseconds time;
+  // Ticket of the job within its order.
+  uint64_t job_id;
+  EventType type;
+};
+
+// The events of one thread. Only written by that thread.
+struct ThreadBuffer {
+  explicit ThreadBuffer(int tid) : tid(tid), events(kEventsPerThread) {}
+
+  const int tid;
+  std::vector<Event> events;
+  // Number of events recorded. The last kEventsPerThread are in events,
+  // indexed by their number modulo the size.
+  uint64_t num_recorded = 0;
+};
+
+// The buffers of all threads which recorded events.
+class Registry {
+ public:
+  static Registry& Get() {
+    static Registry registry;
+    return registry;
+  }
+
+  // Returns the buffer of an exited thread, if any, or else a new one. A
+  // reused buffer keeps its tid and its events, which the new thread then
+  // overwrites.
+  std::shared_ptr<ThreadBuffer> NewBuffer() {
+    std::lock_guard<std::mutex> lck(mtx_);
+    if (!free_buffers_.empty()) {
+      std::shared_ptr<ThreadBuffer> buffer = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+      return buffer;
+    }
+    buffers_.push_back(std::make_shared<ThreadBuffer>(next_tid_++));
+    return buffers_.back();
+  }
+
+  // Called when the thread recording to buffer exits.
+  void ReleaseBuffer(std::shared_ptr<ThreadBuffer> buffer) {
+    std::lock_guard<std::mutex> lck(mtx_);
+    free_buffers_.push_back(std::move(buffer));
+  }
+
+  std::chrono::steady_clock::time_point start() const { return start_; }
+
+  template <class Fn>
+  void ForEachBuffer(Fn fn) {
+    std::lock_guard<std::mutex> lck(mtx_);
+    for (const std::shared_ptr<ThreadBuffer>& buffer : buffers_) {
+      fn(*buffer);
+    }
+  }
+
+ private:
+  const std::chrono::steady_clock::time_point start_ =
+      std::chrono::steady_clock::now();
+  std::mutex mtx_;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+  // Buffers of exited threads, for reuse.
+  std::vector<std::shared_ptr<ThreadBuffer>> free_buffers_;
+  int next_tid_ = 1;
+};
+
+// Holds the buffer of a thread while it runs.
+struct LocalBufferHolder {
+  std::shared_ptr<ThreadBuffer> buffer = Registry::Get().NewBuffer();
+  ~LocalBufferHolder() { Registry::Get().ReleaseBuffer(std::move(buffer)); }
+};
+
+inline ThreadBuffer& LocalBuffer() {
+  static thread_local LocalBufferHolder holder;
+  return *holder.buffer;
+}
+
+// Records an event of the calling thread.
+inline void Record(EventType type, uint64_t job_id) {
+  ThreadBuffer& buffer = LocalBuffer();
+  buffer.events[buffer.num_recorded++ & (kEventsPerThread - 1)] = Event{
+      std::chrono::steady_clock::now() - Registry::Get().start(), job_id, type};
+}
+
+/**
+ * Writes the recorded events of all threads as Chrome trace JSON. The events
+ * are read without synchronization, so this must only be called while no
+ * pool is running jobs, e.g. after OrderedThreadPool::WaitIdle().
+ **/
+inline void WriteChromeTrace(std::ostream& out) {
+  struct Format {
+    const char* name;
+    const char* phase;
+  };
+  // Indexed by EventType.
+  static constexpr Format kFormats[] = {
+      {"enqueue", "i"},    {"dequeue", "i"},     {"job", "B"},
+      {"job", "E"},        {"ticket_wait", "B"}, {"ticket_wait", "E"},
+      {"completion", "B"}, {"completion", "E"},
+  };
+  out << "{\"traceEvents\":[";
+  const char* separator = "\n";
+  Registry::Get().ForEachBuffer([&](const ThreadBuffer& buffer) {
+    out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        << "\"tid\":" << buffer.tid << ",\"args\":{\"name\":\"thread "
+        << buffer.tid << "\"}}";
+    separator = ",\n";
+    uint64_t first = buffer.num_recorded > kEventsPerThread
+                         ? buffer.num_recorded - kEventsPerThread
+                         : 0;
+    for (uint64_t i = first; i < buffer.num_recorded; ++i) {
+      const Event& event = buffer.events[i & (kEventsPerThread - 1)];
+      const Format& format = kFormats[(int)event.type];
+      // Timestamps are in microseconds, written with three decimals.
+      int64_t ns = event.time.count();
+      out << separator << "{\"name\":\"" << format.name << "\",\"ph\":\""
+          << format.phase << "\",\"ts\":" << ns / 1000 << "."
+          << (char)('0' + ns / 100 % 10) << (char)('0' + ns / 10 % 10)
+          << (char)('0' + ns % 10) << ",\"pid\":1,\"tid\":" << buffer.tid;
+      if (format.phase[0] == 'i') {
+        out << ",\"s\":\"t\"";
+      }
+      out << ",\"args\":{\"job_id\":" << event.job_id << "}}";
+    }
+  });
+  out << "\n]}\n";
+}
+
+// Drops the recorded events.
+inline void Clear() {
+  Registry::Get().ForEachBuffer(
+      [](ThreadBuffer& buffer) { buffer.num_recorded = 0; });
+}
+
+#else  // ORDERED_THREAD_POOL_TRACE
+
+constexpr bool kEnabled = false;
+
+inline void Record(EventType, uint64_t) {}
+
+inline void WriteChromeTrace(std::ostream& out) {
+  out << "{\"traceEvents\":[]}\n";
+}
+
+inline void Clear() {}
+
+#endif  // ORDERED_THREAD_POOL_TRACE
+
+}  // namespace pool_trace
+
+#endif  // POOL_TRACE_H
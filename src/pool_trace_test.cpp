@@ -0,0 +1,111 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Built with ORDERED_THREAD_POOL_TRACE defined.
+
+#include "pool_trace.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "ordered_thread_pool.h"
+
+namespace {
+
+int CountOf(const std::string& text, const std::string& pattern) {
+  int count = 0;
+  for (size_t pos = text.find(pattern); pos != std::string::npos;
+       pos = text.find(pattern, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+std::string Trace() {
+  std::ostringstream out;
+  pool_trace::WriteChromeTrace(out);
+  return out.str();
+}
+
+}  // namespace
+
+TEST(PoolTraceTest, Events) {
+  ASSERT_TRUE(pool_trace::kEnabled);
+  pool_trace::Clear();
+  OrderedThreadPool<int> thread_pool{2, 4};
+  // The jobs after the first wait for its ticket.
+  thread_pool.Do(
+      [] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return 0;
+      },
+      [](int) {});
+  for (int i = 1; i < 10; ++i) {
+    thread_pool.Do([i] { return i; }, [](int) {});
+  }
+  thread_pool.WaitIdle();
+  std::string trace = Trace();
+  ASSERT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"enqueue\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"dequeue\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"job\",\"ph\":\"B\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"job\",\"ph\":\"E\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"completion\",\"ph\":\"B\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"completion\",\"ph\":\"E\""), 10);
+  int num_waits = CountOf(trace, "\"name\":\"ticket_wait\",\"ph\":\"B\"");
+  ASSERT_GE(num_waits, 1);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"ticket_wait\",\"ph\":\"E\""),
+            num_waits);
+  ASSERT_GE(CountOf(trace, "\"args\":{\"job_id\":9}"), 6);
+
+  pool_trace::Clear();
+  ASSERT_EQ(CountOf(Trace(), "\"name\":\"job\""), 0);
+}
+
+TEST(PoolTraceTest, ReorderBuffer) {
+  pool_trace::Clear();
+  {
+    OrderedThreadPool<int> thread_pool{2, {.reorder_buffer = true}};
+    for (int i = 0; i < 10; ++i) {
+      thread_pool.Do([i] { return i; }, [](int) {});
+    }
+  }
+  std::string trace = Trace();
+  ASSERT_EQ(CountOf(trace, "\"name\":\"job\",\"ph\":\"B\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"completion\",\"ph\":\"B\""), 10);
+  ASSERT_EQ(CountOf(trace, "\"name\":\"ticket_wait\""), 0);
+}
+
+// Workers which come and go reuse the buffers of those which have exited.
+TEST(PoolTraceTest, BuffersReused) {
+  for (int i = 0; i < 10; ++i) {
+    OrderedThreadPool<int> thread_pool{2};
+    thread_pool.Do([i] { return i; }, [](int) {});
+  }
+  int num_threads = CountOf(Trace(), "\"thread_name\"");
+  for (int i = 0; i < 50; ++i) {
+    OrderedThreadPool<int> thread_pool{2};
+    thread_pool.Do([i] { return i; }, [](int) {});
+  }
+  ASSERT_EQ(CountOf(Trace(), "\"thread_name\""), num_threads);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
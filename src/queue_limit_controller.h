@@ -0,0 +1,145 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Picks the limit on pending jobs of a pool at runtime.
+//
+// Too low a limit leaves workers idle between submissions, and too high a
+// limit lets jobs sit in the queue, holding memory and adding latency. The
+// workers report how long they waited for a job, and how long the job waited
+// for them. Once per interval the limit is adjusted with an AIMD rule -
+// - If jobs waited longer than the target on average, the limit is halved.
+// - Otherwise, if workers were idle for a noticeable part of the interval, the
+//   limit is raised by one.
+//
+// Example -
+//
+//   QueueLimitController controller{{.initial = 4, .min = 1, .max = 256}};
+//   // In each worker, after taking a job -
+//   if (std::optional<int> limit =
+//           controller.Record(now, idle, queue_wait, num_workers)) {
+//     queue.SetMaxPending(*limit);
+//   }
+//
+#ifndef QUEUE_LIMIT_CONTROLLER_H
+#define QUEUE_LIMIT_CONTROLLER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+
+class QueueLimitController {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    // Limits to start with, and to stay within.
+    int initial = 1;
+    int min = 1;
+    int max = 1024;
+    // The limit is lowered while jobs wait in the queue longer than this on
+    // average.
+    std::chrono::nanoseconds target_queue_wait = std::chrono::milliseconds(1);
+    // How often the limit is adjusted.
+    std::chrono::nanoseconds interval = std::chrono::milliseconds(10);
+  };
+
+  // The limit is raised if the workers were idle for more than this part of
+  // the interval.
+  static constexpr double kIdleFraction = 0.05;
+
+  explicit QueueLimitController(const Options& options)
+      : options_(options),
+        limit_(std::clamp(options.initial, options.min, options.max)),
+        last_adjusted_(ToNs(Clock::now().time_since_epoch())) {}
+
+  // The current limit.
+  int limit() const { return limit_.load(std::memory_order_relaxed); }
+
+  /**
+   * Called by a worker each time it takes a job.
+   *
+   * @param now The time the job was taken.
+   * @param idle How long the worker waited for the job.
+   * @param queue_wait How long the job waited in the queue.
+   * @param num_workers Number of workers reporting now, to tell which part of
+   *   their time was idle. May change as the pool is resized.
+   * @return The new limit, if this call changed it.
+   **/
+  std::optional<int> Record(Clock::time_point now, Clock::duration idle,
+                            Clock::duration queue_wait, int num_workers) {
+    idle_ns_.fetch_add(ToNs(idle), std::memory_order_relaxed);
+    queue_wait_ns_.fetch_add(ToNs(queue_wait), std::memory_order_relaxed);
+    num_jobs_.fetch_add(1, std::memory_order_relaxed);
+    int64_t now_ns = ToNs(now.time_since_epoch());
+    int64_t last = last_adjusted_.load(std::memory_order_relaxed);
+    if (now_ns - last < ToNs(options_.interval)) {
+      return {};
+    }
+    // One worker adjusts, the others move on.
+    std::unique_lock<std::mutex> lck(mtx_, std::try_to_lock);
+    if (!lck.owns_lock() || last_adjusted_.load() != last) {
+      return {};
+    }
+    last_adjusted_.store(now_ns, std::memory_order_relaxed);
+    return Adjust(now_ns - last, num_workers);
+  }
+
+ private:
+  static int64_t ToNs(Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+  }
+
+  // Applies the AIMD rule to the measurements of num_workers over the last
+  // elapsed_ns. Must hold mtx_.
+  std::optional<int> Adjust(int64_t elapsed_ns, int num_workers) {
+    int64_t idle_ns = idle_ns_.exchange(0, std::memory_order_relaxed);
+    int64_t queue_wait_ns =
+        queue_wait_ns_.exchange(0, std::memory_order_relaxed);
+    int64_t num_jobs = num_jobs_.exchange(0, std::memory_order_relaxed);
+    int limit = limit_.load(std::memory_order_relaxed);
+    int new_limit = limit;
+    if (num_jobs > 0 &&
+        queue_wait_ns / num_jobs > options_.target_queue_wait.count()) {
+      new_limit = std::max(options_.min, limit / 2);
+    } else if (idle_ns >
+               kIdleFraction * elapsed_ns * std::max(1, num_workers)) {
+      new_limit = std::min(options_.max, limit + 1);
+    }
+    if (new_limit == limit) {
+      return {};
+    }
+    limit_.store(new_limit, std::memory_order_relaxed);
+    return new_limit;
+  }
+
+  const Options options_;
+  std::atomic<int> limit_;
+
+  // Measurements since the last adjustment.
+  std::atomic<int64_t> idle_ns_{0};
+  std::atomic<int64_t> queue_wait_ns_{0};
+  std::atomic<int64_t> num_jobs_{0};
+  // Time of the last adjustment, in nanoseconds since the epoch of Clock.
+  std::atomic<int64_t> last_adjusted_;
+  // Held by the worker adjusting the limit.
+  std::mutex mtx_;
+};
+
+#endif  // QUEUE_LIMIT_CONTROLLER_H
@@ -0,0 +1,97 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "queue_limit_controller.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <optional>
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+TEST(QueueLimitControllerTest, ClampsInitial) {
+  QueueLimitController controller{{.initial = 0, .min = 2, .max = 8}};
+  ASSERT_EQ(controller.limit(), 2);
+}
+
+// Idle workers raise the limit by one per interval, up to max.
+TEST(QueueLimitControllerTest, AdditiveIncrease) {
+  QueueLimitController controller{
+      {.initial = 1, .min = 1, .max = 3, .interval = milliseconds(10)}};
+  auto now = QueueLimitController::Clock::now();
+  // Within the interval nothing changes.
+  ASSERT_EQ(controller.Record(now, milliseconds(5), microseconds(0), 1),
+            std::nullopt);
+  for (int expected : {2, 3}) {
+    now += milliseconds(10);
+    ASSERT_EQ(controller.Record(now, milliseconds(5), microseconds(0), 1),
+              expected);
+  }
+  now += milliseconds(10);
+  ASSERT_EQ(controller.Record(now, milliseconds(5), microseconds(0), 1),
+            std::nullopt);
+  ASSERT_EQ(controller.limit(), 3);
+}
+
+// Jobs waiting longer than the target halve the limit, down to min.
+TEST(QueueLimitControllerTest, MultiplicativeDecrease) {
+  QueueLimitController controller{{.initial = 20,
+                                   .min = 4,
+                                   .max = 100,
+                                   .target_queue_wait = milliseconds(1),
+                                   .interval = milliseconds(10)}};
+  auto now = QueueLimitController::Clock::now();
+  for (int expected : {10, 5, 4}) {
+    now += milliseconds(10);
+    // Queue wait outweighs idleness.
+    ASSERT_EQ(controller.Record(now, milliseconds(5), milliseconds(2), 1),
+              expected);
+  }
+}
+
+// Busy workers and short waits keep the limit.
+TEST(QueueLimitControllerTest, Steady) {
+  QueueLimitController controller{{.initial = 8,
+                                   .target_queue_wait = milliseconds(1),
+                                   .interval = milliseconds(10)}};
+  auto now = QueueLimitController::Clock::now();
+  for (int i = 0; i < 10; ++i) {
+    now += milliseconds(10);
+    ASSERT_EQ(controller.Record(now, microseconds(10), microseconds(100), 4),
+              std::nullopt);
+  }
+  ASSERT_EQ(controller.limit(), 8);
+}
+
+// Idleness is weighed against the number of workers reporting at the time, so
+// that it stays right as the pool is resized.
+TEST(QueueLimitControllerTest, NumWorkersChange) {
+  QueueLimitController controller{
+      {.initial = 1, .min = 1, .max = 8, .interval = milliseconds(10)}};
+  auto now = QueueLimitController::Clock::now();
+  now += milliseconds(10);
+  // 5ms idle in 10ms is little for 16 workers.
+  ASSERT_EQ(controller.Record(now, milliseconds(5), microseconds(0), 16),
+            std::nullopt);
+  now += milliseconds(10);
+  // But a lot for one.
+  ASSERT_EQ(controller.Record(now, milliseconds(5), microseconds(0), 1), 2);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A set of counters which many threads can add to without contending.
+//
+// Each thread adds to one of kNumShards copies of the counters, each on its
+// own cache line, picked round-robin when the thread first adds. Reading sums
+// up the shards, so it is slower than adding and only approximately a
+// snapshot while other threads add.
+//
+// Example -
+//
+//   enum { kJobs, kBytes, kNumCounters };
+//   ShardedCounters<kNumCounters> counters;
+//   counters.Add(kJobs, 1);
+//   counters.Add(kBytes, size);
+//   uint64_t num_jobs = counters.Sum(kJobs);
+//
+#ifndef SHARDED_COUNTERS_H
+#define SHARDED_COUNTERS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+template <size_t NumCounters>
+class ShardedCounters {
+ public:
+  // Power of two. Threads beyond this many share shards.
+  static constexpr size_t kNumShards = 16;
+
+  void Add(size_t counter, uint64_t value) {
+    shards_[ShardIndex()].values[counter].fetch_add(value,
+                                                    std::memory_order_relaxed);
+  }
+
+  uint64_t Sum(size_t counter) const {
+    uint64_t sum = 0;
+    for (const Shard& shard : shards_) {
+      sum += shard.values[counter].load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> values[NumCounters] = {};
+  };
+
+  // The shard of the calling thread. Shared by all ShardedCounters, so that
+  // threads spread over the shards of each.
+  static size_t ShardIndex() {
+    static std::atomic<size_t> next_index{0};
+    static thread_local size_t index =
+        next_index.fetch_add(1, std::memory_order_relaxed) & (kNumShards - 1);
+    return index;
+  }
+
+  Shard shards_[kNumShards];
+};
+
+#endif  // SHARDED_COUNTERS_H
@@ -0,0 +1,48 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sharded_counters.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+TEST(ShardedCountersTest, SingleThread) {
+  ShardedCounters<2> counters;
+  ASSERT_EQ(counters.Sum(0), 0);
+  counters.Add(0, 3);
+  counters.Add(0, 4);
+  counters.Add(1, 10);
+  ASSERT_EQ(counters.Sum(0), 7);
+  ASSERT_EQ(counters.Sum(1), 10);
+}
+
+// More threads than shards, so that some share a shard.
+TEST(ShardedCountersTest, ManyThreads) {
+  ShardedCounters<1> counters;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 40; ++i) {
+    threads.emplace_back([&counters] {
+      for (int j = 0; j < 1000; ++j) counters.Add(0, 1);
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  ASSERT_EQ(counters.Sum(0), 40000);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
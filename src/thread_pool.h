@@ -14,9 +14,11 @@
  * limitations under the License.
  */
 
-// Uses OrderedThreadPool to define a simple thread pool.
+// A simple thread pool.
 //
-// Ordered execution is not guaranteed.
+// Ordered execution is not guaranteed. Unlike OrderedThreadPool, jobs do not
+// return a value, and workers never wait for each other, so there is no
+// ticket system to pay for.
 //
 // Example -
 //
@@ -28,26 +30,166 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <chrono>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "job_queue.h"
+#include "move_only_function.h"
+#include "pool_future.h"
+// For OrderedThreadPoolOptions.
 #include "ordered_thread_pool.h"
 
-class ThreadPool : public OrderedThreadPool<int> {
+class ThreadPool {
+  using JobFnT = MoveOnlyFunction<void()>;
+
  public:
+  /**
+   * Instantiates a thread pool.
+   *
+   * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+   *   threads, and use the calling thread to perform the work.
+   * @param max_pending_jobs If the workers are all occupied, and this many jobs
+   *   are in the queue, calling thread will be blocked till a worker is free.
+   **/
   ThreadPool(int num_workers, int max_pending_jobs = 1)
-      : OrderedThreadPool(num_workers, max_pending_jobs) {}
-  void Do(std::function<void()> fn) {
-    OrderedThreadPool::Do(
-        // It is important to pass the fn _not_ by reference, since it will be
-        // executed with a delay.
-        [fn] {
-          fn();
-          return 0;
-        },
-        [](int) {});
+      : ThreadPool(num_workers, OrderedThreadPoolOptions{
+                                    .max_pending_jobs = max_pending_jobs,
+                                }) {}
+
+  /**
+   * Instantiates a thread pool with non-default options.
+   *
+   * @param num_workers Number of workers to spawn. A value of 0 will spawn no
+   *   threads, and use the calling thread to perform the work.
+   * @param options See OrderedThreadPoolOptions. Only max_pending_jobs,
+   *   lock_free_queue, work_stealing and wait_policy are used. The others
+   *   are ignored.
+   **/
+  ThreadPool(int num_workers, const OrderedThreadPoolOptions& options)
+      : fn_queue_(options.max_pending_jobs, options.lock_free_queue,
+                  options.work_stealing ? num_workers : 0,
+                  options.wait_policy) {
+    for (int i = 0; i < num_workers; ++i) {
+      workers_.push_back(std::thread(&ThreadPool::Worker, this, i));
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * Queues fn to be run on one of the workers.
+   *
+   * @param fn The job. It is moved into the pool, and may be move-only.
+   **/
+  void Do(JobFnT fn) {
+    if (workers_.empty()) {
+      // Number of threads requested is 0. Run everything on main thread.
+      fn();
+      return;
+    }
+    fn_queue_.Push([&fn] { return std::move(fn); });
+  }
+
+  /**
+   * Like Do(), but returns false right away instead of blocking if the queue
+   * is full. fn is only moved from if it is accepted.
+   **/
+  bool TryDo(JobFnT&& fn) {
+    return DoUntil(JobQueue<JobFnT>::Clock::time_point::min(), std::move(fn));
+  }
+
+  /**
+   * Like TryDo(), but waits up to timeout for room in the queue.
+   **/
+  template <class Rep, class Period>
+  bool DoFor(const std::chrono::duration<Rep, Period>& timeout, JobFnT&& fn) {
+    return DoUntil(JobQueue<JobFnT>::Clock::now() + timeout, std::move(fn));
+  }
+
+  /**
+   * Like TryDo(), but waits till deadline for room in the queue.
+   **/
+  template <class Clock, class Duration>
+  bool DoUntil(const std::chrono::time_point<Clock, Duration>& deadline,
+               JobFnT&& fn) {
+    if (workers_.empty()) {
+      fn();
+      return true;
+    }
+    return fn_queue_.PushUntil(JobQueue<JobFnT>::ToClock(deadline),
+                               [&fn] { return std::move(fn); });
+  }
+
+  /**
+   * Queues fn to be run on one of the workers, and returns a future for its
+   * result.
+   *
+   * @param fn The job. May return void.
+   **/
+  template <class Fn>
+  PoolFuture<std::invoke_result_t<Fn&>> DoAsync(Fn fn) {
+    using Result = std::invoke_result_t<Fn&>;
+    PoolPromise<Result> promise;
+    PoolFuture<Result> future = promise.GetFuture();
+    Do([fn = std::move(fn), promise = std::move(promise)]() mutable {
+      if constexpr (std::is_void_v<Result>) {
+        fn();
+        promise.Set();
+      } else {
+        promise.Set(fn());
+      }
+    });
+    return future;
+  }
+
+  /**
+   * Returns an awaitable for C++20 coroutines, which resumes the awaiting
+   * coroutine on one of the workers -
+   *
+   *   co_await pool.Schedule();
+   **/
+  auto Schedule() { return ScheduleAwaiter{this}; }
+
+  // Number of worker threads. 0 if jobs run on the calling thread.
+  int num_workers() const { return workers_.size(); }
+
+  virtual ~ThreadPool() {
+    // Workers finish the entire queue and exit.
+    fn_queue_.Close();
+    for (std::thread& t : workers_) {
+      t.join();
+    }
   }
 
  private:
-  // Hide the inherited form of Do that takes two arguments.
-  using OrderedThreadPool::Do;
+  // Templated on the coroutine handle, so that this header does not need
+  // <coroutine> and still compiles as C++17.
+  struct ScheduleAwaiter {
+    ThreadPool* pool;
+
+    bool await_ready() const { return pool->workers_.empty(); }
+    template <class Handle>
+    void await_suspend(Handle handle) {
+      pool->Do([handle] { handle.resume(); });
+    }
+    void await_resume() const {}
+  };
+
+  void Worker(int worker_index) {
+    while (std::optional<JobFnT> fn = fn_queue_.Pop(worker_index)) {
+      (*fn)();
+    }
+  }
+
+  // The worker threads are initialized on construction and maintained.
+  std::vector<std::thread> workers_;
+  // Queue of functions to execute.
+  JobQueue<JobFnT> fn_queue_;
 };
 
 #endif  // THREAD_POOL_H
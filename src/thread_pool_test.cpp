@@ -16,7 +16,19 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <thread>
+
+TEST(ThreadPoolTest, Unthreaded) {
+  std::vector<int> visited;
+  ThreadPool thread_pool{0};
+  for (int i = 0; i < 5; ++i) {
+    thread_pool.Do([&visited, i] { visited.push_back(i); });
+  }
+  ASSERT_EQ(visited, (std::vector<int>{0, 1, 2, 3, 4}));
+}
 
 TEST(ThreadPoolTest, Threaded) {
   std::vector<int> visit_count(50, 0);
@@ -50,6 +62,63 @@ TEST(ThreadPoolTest, MultiplePusher) {
   ASSERT_EQ(visit_count, std::vector<int>(1000, 1));
 }
 
+TEST(ThreadPoolTest, WorkStealing) {
+  std::vector<int> visit_count(1000, 0);
+  {
+    ThreadPool thread_pool{4, {.max_pending_jobs = 8, .work_stealing = true}};
+    for (int i = 0; i < 1000; ++i) {
+      thread_pool.Do([&visit_count, i] { ++visit_count[i]; });
+    }
+  }
+  ASSERT_EQ(visit_count, std::vector<int>(1000, 1));
+}
+
+TEST(ThreadPoolTest, DoAsync) {
+  ThreadPool thread_pool{4, 2};
+  std::vector<PoolFuture<int>> futures;
+  for (int i = 0; i < 100; ++i) {
+    futures.push_back(thread_pool.DoAsync([i] { return i * i; }));
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(futures[i].Get(), i * i);
+  }
+}
+
+TEST(ThreadPoolTest, DoAsyncVoid) {
+  ThreadPool thread_pool{2};
+  std::atomic<int> num_run{0};
+  PoolFuture<int> future =
+      thread_pool.DoAsync([&num_run] { ++num_run; }).Then([&num_run] {
+        return num_run.load();
+      });
+  ASSERT_EQ(future.Get(), 1);
+}
+
+TEST(ThreadPoolTest, TryDo) {
+  std::atomic<bool> started{false};
+  std::atomic<bool> release{false};
+  std::atomic<int> num_run{0};
+  int num_accepted = 1;
+  {
+    ThreadPool thread_pool{1, 1};
+    thread_pool.Do([&] {
+      started = true;
+      while (!release) std::this_thread::yield();
+    });
+    while (!started) std::this_thread::yield();
+    while (num_accepted < 100 && thread_pool.TryDo([&num_run] { ++num_run; })) {
+      ++num_accepted;
+    }
+    ASSERT_LT(num_accepted, 100);
+    ASSERT_FALSE(thread_pool.DoFor(std::chrono::milliseconds(5),
+                                   [&num_run] { ++num_run; }));
+    release = true;
+    ASSERT_TRUE(thread_pool.DoFor(std::chrono::seconds(10),
+                                  [&num_run] { ++num_run; }));
+  }
+  ASSERT_EQ(num_run, num_accepted);
+}
+
 // Demonstrates passing parameters via unique_ptr.
 TEST(ThreadPoolTest, UniquePtr) {
   std::vector<int> visit_count(50, 0);
@@ -57,10 +126,10 @@ TEST(ThreadPoolTest, UniquePtr) {
     ThreadPool thread_pool{10, 5};
     for (int i = 0; i < 50; ++i) {
       auto uptr = std::make_unique<int>(i);
-      // Move to a shared ptr to make it copyable, as we send the function as a
-      // copy.
-      std::shared_ptr<int> sptr = std::move(uptr);
-      thread_pool.Do([&visit_count, sptr] { ++visit_count[*sptr]; });
+      // Jobs are moved into the pool, so they may own move-only values.
+      thread_pool.Do([&visit_count, uptr = std::move(uptr)] {
+        ++visit_count[*uptr];
+      });
     }
   }
   ASSERT_EQ(visit_count, std::vector<int>(50, 1));
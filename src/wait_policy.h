@@ -0,0 +1,103 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// How a thread waits before going to sleep on a condition variable.
+//
+// Sleeping and being woken up costs several microseconds. When waits are
+// expected to be shorter than that, a thread can first spin on the condition,
+// then yield its time slice, and only then park.
+//
+// Example -
+//
+//   WaitPolicy policy{.spin_iterations = 1000, .yield_iterations = 10};
+//   if (!SpinUntil(policy, [&] { return ready.load(); })) {
+//     std::unique_lock<std::mutex> lck(mtx);
+//     cv.wait(lck, [&] { return ready.load(); });
+//   }
+//
+#ifndef WAIT_POLICY_H
+#define WAIT_POLICY_H
+
+#include <thread>
+
+struct WaitPolicy {
+  // Number of times to check the condition with a pause instruction between
+  // checks.
+  int spin_iterations = 0;
+  // Number of times to check the condition with std::this_thread::yield()
+  // between checks, once spinning is exhausted.
+  int yield_iterations = 0;
+
+  // False if a waiting thread parks right away.
+  bool Spins() const { return spin_iterations > 0 || yield_iterations > 0; }
+};
+
+// Tells the CPU that this is a spin loop. Saves power and, with
+// hyper-threading, lets the sibling thread run.
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+// Steps through the spinning and yielding phases of a WaitPolicy.
+class Backoff {
+ public:
+  explicit Backoff(const WaitPolicy& policy) : policy_(policy) {}
+
+  /**
+   * Waits a little before the condition is checked again.
+   *
+   * @return False once the policy is exhausted, without waiting. The caller
+   *   should then park.
+   **/
+  bool Pause() {
+    if (iteration_ < policy_.spin_iterations) {
+      CpuRelax();
+    } else if (iteration_ <
+               policy_.spin_iterations + policy_.yield_iterations) {
+      std::this_thread::yield();
+    } else {
+      return false;
+    }
+    ++iteration_;
+    return true;
+  }
+
+ private:
+  const WaitPolicy& policy_;
+  int iteration_ = 0;
+};
+
+/**
+ * Checks ready() till it holds or the policy is exhausted.
+ *
+ * @return The last value of ready(). If false, the caller should park.
+ **/
+template <class ReadyFn>
+bool SpinUntil(const WaitPolicy& policy, ReadyFn ready) {
+  Backoff backoff{policy};
+  while (!ready()) {
+    if (!backoff.Pause()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif  // WAIT_POLICY_H
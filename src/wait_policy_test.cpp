@@ -0,0 +1,62 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "wait_policy.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+
+TEST(WaitPolicyTest, DefaultParksRightAway) {
+  WaitPolicy policy;
+  ASSERT_FALSE(policy.Spins());
+  Backoff backoff{policy};
+  ASSERT_FALSE(backoff.Pause());
+}
+
+TEST(WaitPolicyTest, BackoffCountsBothPhases) {
+  WaitPolicy policy{.spin_iterations = 3, .yield_iterations = 2};
+  ASSERT_TRUE(policy.Spins());
+  Backoff backoff{policy};
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(backoff.Pause());
+  }
+  ASSERT_FALSE(backoff.Pause());
+}
+
+TEST(WaitPolicyTest, SpinUntil) {
+  int checks = 0;
+  ASSERT_FALSE(SpinUntil(WaitPolicy{.spin_iterations = 4},
+                         [&checks] { return ++checks > 10; }));
+  // Checked once before each pause, and once after the last.
+  ASSERT_EQ(checks, 5);
+  checks = 0;
+  ASSERT_TRUE(SpinUntil(WaitPolicy{.spin_iterations = 4},
+                        [&checks] { return ++checks > 2; }));
+  ASSERT_EQ(checks, 3);
+}
+
+TEST(WaitPolicyTest, SeesOtherThread) {
+  std::atomic<bool> ready{false};
+  std::thread setter{[&ready] { ready = true; }};
+  ASSERT_TRUE(SpinUntil(WaitPolicy{.yield_iterations = 1000000},
+                        [&ready] { return ready.load(); }));
+  setter.join();
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A Chase-Lev work-stealing deque.
+//
+// One owner thread pushes and pops at the bottom, without contention unless
+// the deque is down to its last element. Any number of thieves steal from the
+// top. The buffer grows as needed; retired buffers are kept till destruction,
+// since a thief may still be reading from them.
+//
+// The elements are read speculatively by thieves, so T must be trivially
+// copyable. Typically it is a pointer.
+//
+// Example -
+//
+//   WorkStealingDeque<Job*> deque;
+//   deque.Push(job);                             // Owner.
+//   std::optional<Job*> mine = deque.Pop();      // Owner.
+//   std::optional<Job*> stolen = deque.Steal();  // Any thread.
+//
+#ifndef WORK_STEALING_DEQUE_H
+#define WORK_STEALING_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+template <class T>
+class WorkStealingDeque {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Elements are copied while they may be overwritten.");
+
+ public:
+  explicit WorkStealingDeque(size_t initial_capacity = 64) {
+    size_t capacity = 1;
+    while (capacity < initial_capacity) capacity *= 2;
+    buffers_.push_back(std::make_unique<Buffer>(capacity));
+    buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+  }
+
+  // Not copyable or movable, since other threads steal from it.
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+  // Adds a value at the bottom. Only the owner may call this.
+  void Push(T value) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    if (bottom - top >= (int64_t)buffer->capacity) {
+      buffer = Grow(buffer, top, bottom);
+    }
+    buffer->Put(bottom, value);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+
+  // Removes the most recently pushed value. Only the owner may call this.
+  std::optional<T> Pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      // Empty.
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return {};
+    }
+    T value = buffer->Get(bottom);
+    if (top == bottom) {
+      // The last element. Race against thieves for it.
+      bool won = top_.compare_exchange_strong(top, top + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed);
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      if (!won) return {};
+    }
+    return value;
+  }
+
+  // Removes the oldest value. Safe to call from any thread. May spuriously
+  // return empty if it loses a race to another thief or to the owner.
+  std::optional<T> Steal() {
+    int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) {
+      return {};
+    }
+    Buffer* buffer = buffer_.load(std::memory_order_acquire);
+    T value = buffer->Get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return {};
+    }
+    return value;
+  }
+
+  // Approximate number of elements.
+  size_t Size() const {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_relaxed);
+    return bottom > top ? bottom - top : 0;
+  }
+
+ private:
+  // Avoids false sharing between the owner's and the thieves' counters.
+  static constexpr size_t kCacheLineSize = 64;
+
+  struct Buffer {
+    explicit Buffer(size_t capacity)
+        : capacity(capacity), cells(new std::atomic<T>[capacity]) {}
+    T Get(int64_t i) const {
+      return cells[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void Put(int64_t i, T value) {
+      cells[i & (capacity - 1)].store(value, std::memory_order_relaxed);
+    }
+
+    const size_t capacity;
+    std::unique_ptr<std::atomic<T>[]> cells;
+  };
+
+  // Copies the live elements into a buffer of twice the size.
+  Buffer* Grow(Buffer* buffer, int64_t top, int64_t bottom) {
+    buffers_.push_back(std::make_unique<Buffer>(buffer->capacity * 2));
+    Buffer* grown = buffers_.back().get();
+    for (int64_t i = top; i < bottom; ++i) {
+      grown->Put(i, buffer->Get(i));
+    }
+    buffer_.store(grown, std::memory_order_release);
+    return grown;
+  }
+
+  alignas(kCacheLineSize) std::atomic<int64_t> top_{0};
+  alignas(kCacheLineSize) std::atomic<int64_t> bottom_{0};
+  std::atomic<Buffer*> buffer_;
+  // All buffers ever used. Only the owner appends to this.
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+#endif  // WORK_STEALING_DEQUE_H
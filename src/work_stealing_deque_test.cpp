@@ -0,0 +1,82 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "work_stealing_deque.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+TEST(WorkStealingDequeTest, OwnerLifoThiefFifo) {
+  WorkStealingDeque<int> deque{2};
+  // Pushes beyond the initial capacity to exercise growing.
+  for (int i = 0; i < 10; ++i) {
+    deque.Push(i);
+  }
+  ASSERT_EQ(deque.Size(), 10);
+  ASSERT_EQ(deque.Pop(), 9);
+  ASSERT_EQ(deque.Steal(), 0);
+  ASSERT_EQ(deque.Pop(), 8);
+  ASSERT_EQ(deque.Steal(), 1);
+  ASSERT_EQ(deque.Size(), 6);
+  for (int i = 7; i >= 2; --i) {
+    ASSERT_EQ(deque.Pop(), i);
+  }
+  ASSERT_FALSE(deque.Pop().has_value());
+  ASSERT_FALSE(deque.Steal().has_value());
+}
+
+// Every value pushed by the owner is taken exactly once, by either the owner
+// or one of the thieves.
+TEST(WorkStealingDequeTest, ConcurrentSteals) {
+  constexpr int kNumValues = 100000;
+  WorkStealingDeque<int> deque;
+  std::vector<std::atomic<int>> visit_count(kNumValues);
+  std::atomic<bool> done{false};
+  std::vector<std::thread> thieves;
+  for (int t = 0; t < 3; ++t) {
+    thieves.emplace_back([&] {
+      while (!done) {
+        if (std::optional<int> value = deque.Steal()) {
+          ++visit_count[*value];
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumValues; ++i) {
+    deque.Push(i);
+    if (i % 3 == 0) {
+      if (std::optional<int> value = deque.Pop()) {
+        ++visit_count[*value];
+      }
+    }
+  }
+  while (std::optional<int> value = deque.Pop()) {
+    ++visit_count[*value];
+  }
+  done = true;
+  for (std::thread& t : thieves) {
+    t.join();
+  }
+  for (int i = 0; i < kNumValues; ++i) {
+    ASSERT_EQ(visit_count[i], 1) << i;
+  }
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}